@@ -10,192 +10,187 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "Counter.h"
 
-// counter struct, left untouched
+// a new counter starts with 2^INITIAL_SLOT_BITS slots
+#define INITIAL_SLOT_BITS 6
+
+// counter struct
+// single byte characters are counted directly in ascii,
+// longer ones in an open addressed hash table of slots.
 struct counter {
-    struct counter *left;
-    struct counter *right;
-    char character[5];
-    unsigned int count;
+    unsigned int ascii[128];
+    struct slot *slots;
+    int slotBits;
+    int slotsUsed;
+    int numItems;
 };
 
-// CUSTOM STRUCTS AND FUNCTIONS
-
-// limited Queue implementation, used for numList.
-struct queue {
-    struct node *head;
-    struct node *tail;
+// a slot in the hash table, unused if key is 0
+// the key holds the bytes of the character, which is unique
+// as characters are at most 4 bytes long.
+struct slot {
+    uint32_t key;
+    unsigned int count;
 };
 
-// node struct for queue
-struct node {
-    void *content;
-    struct node *next;
-};
+// CUSTOM FUNCTIONS
 
-// queue functions
-static struct queue *queueNew(void);
-static struct node *queuePop(struct queue *);
-static bool queueIsEmpty(struct queue *);
-static void queueInsert(struct queue *, void *);
-static void queueFree(struct queue *);
+static uint32_t characterKey(char *character);
+static void addCount(Counter c, uint32_t key, unsigned int count);
+static struct slot *findSlot(Counter c, uint32_t key);
+static void growSlots(Counter c);
 
-// create new counter tree
+// create new counter
 // performance: O(1)
 Counter CounterNew(void) {
     struct counter *newCounter = malloc(sizeof(struct counter));
-    newCounter->left = NULL;
-    newCounter->right = NULL;
-    newCounter->character[0] = '\0';
-    newCounter->count = 0;
+    memset(newCounter->ascii, 0, sizeof(newCounter->ascii));
+    newCounter->slotBits = INITIAL_SLOT_BITS;
+    newCounter->slots = calloc(1 << INITIAL_SLOT_BITS, sizeof(struct slot));
+    newCounter->slotsUsed = 0;
+    newCounter->numItems = 0;
     return newCounter;
 }
 
-// free counter tree
-// performance: O(n),
+// free counter
+// performance: O(1)
 void CounterFree(Counter c) {
-    // free branches first then itself
-    if (c->left != NULL) {
-        CounterFree(c->left);
-    }
-    if (c->right != NULL) {
-        CounterFree(c->right);
-    }
+    free(c->slots);
     free(c);
 }
 
-// record character to counter tree
-// performance: O(h)
+// record character to counter
+// performance: O(1) amortised
 void CounterAdd(Counter c, char *character) {
-    if (c->character[0] == '\0') {
-        // case 0: initial tree is empty
-        strncpy(c->character, character, 5);
-        c->count++;
-    } else if (!strcmp(c->character, character)) {
-        c->count++;
-    } else if (strcmp(c->character, character) < 0) {
-        if (c->left == NULL) {
-            c->left = CounterNew();
-        }
-        CounterAdd(c->left, character);
+    addCount(c, characterKey(character), 1);
+}
 
-    } else if (strcmp(c->character, character) > 0) {
-        if (c->right == NULL) {
-            c->right = CounterNew();
+// add the counts of another counter
+// performance: O(m), where m is the size of other
+void CounterMerge(Counter c, Counter other) {
+    for (uint32_t key = 0; key < 128; key++) {
+        if (other->ascii[key] != 0) {
+            addCount(c, key, other->ascii[key]);
+        }
+    }
+    for (int ix = 0; ix < (1 << other->slotBits); ix++) {
+        if (other->slots[ix].key != 0) {
+            addCount(c, other->slots[ix].key, other->slots[ix].count);
         }
-        CounterAdd(c->right, character);
     }
 }
 
-// count the number of unique items recorded by tree
-// performance: O(n)
+// count the number of unique items recorded by counter
+// performance: O(1)
 int CounterNumItems(Counter c) {
-    // base case
-    if (c == NULL) {
-        return 0;
-    }
-    return 1 + CounterNumItems(c->left) + CounterNumItems(c->right);
+    return c->numItems;
 }
 
 // get the frequency of a given character.
-// performance: O(h)
+// performance: O(1)
 int CounterGet(Counter c, char *character) {
-    Counter cPtr = c;
-    while (cPtr != NULL) {
-        if (!strcmp(cPtr->character, character)) {
-            return cPtr->count;
-        } else if (strcmp(cPtr->character, character) < 0) {
-            cPtr = cPtr->left;
-        } else if (strcmp(cPtr->character, character) > 0) {
-            cPtr = cPtr->right;
-        } else {
-            // this is unreachable.
-            // so return a nonsensical value if we get here somehow.
-            return -1;
-        }
+    uint32_t key = characterKey(character);
+    if (key < 128) {
+        return c->ascii[key];
     }
-    return 0;
+    return findSlot(c, key)->count;
 }
 
-// creates an item list from the counter tree
-// traverses tree in level order.
+// creates an item list from the counter
+// single byte characters come first, in order.
 // performance: O(n)
 struct item *CounterItems(Counter c, int *numItems) {
-    struct item *items = malloc(sizeof(struct item) * CounterNumItems(c));
+    struct item *items = malloc(sizeof(struct item) * c->numItems);
     int itemsArrayCount = 0;
-    struct queue *counterQueue = queueNew();
-    queueInsert(counterQueue, c);
-    while (!queueIsEmpty(counterQueue)) {
-        struct node *dequeued = queuePop(counterQueue);
-        Counter counterToItem = dequeued->content;
-
-        strncpy(items[itemsArrayCount].character, counterToItem->character, 5);
-        items[itemsArrayCount].freq = counterToItem->count;
-
-        itemsArrayCount++;
-        if (counterToItem->left != NULL) {
-            queueInsert(counterQueue, counterToItem->left);
+    for (uint32_t key = 0; key < 128; key++) {
+        if (c->ascii[key] != 0) {
+            items[itemsArrayCount].character[0] = key;
+            items[itemsArrayCount].character[1] = '\0';
+            items[itemsArrayCount].freq = c->ascii[key];
+            itemsArrayCount++;
+        }
+    }
+    for (int ix = 0; ix < (1 << c->slotBits); ix++) {
+        struct slot *slot = &c->slots[ix];
+        if (slot->key == 0) {
+            continue;
         }
-        if (counterToItem->right != NULL) {
-            queueInsert(counterQueue, counterToItem->right);
+        for (int byte = 0; byte <= MAX_CHARACTER_LEN; byte++) {
+            items[itemsArrayCount].character[byte] =
+                byte < MAX_CHARACTER_LEN ? slot->key >> (8 * byte) : '\0';
         }
-        free(dequeued);
+        items[itemsArrayCount].freq = slot->count;
+        itemsArrayCount++;
     }
-    queueFree(counterQueue);
     *numItems = itemsArrayCount;
     return items;
 }
 
-// helper functions for function items, uses internal queue implementation.
+// helper functions for the hash table.
 
-// create new queue.
+// pack the bytes of a character into a key.
 // performance: O(1)
-static struct queue *queueNew() {
-    struct queue *q = malloc(sizeof(struct queue));
-    q->head = NULL;
-    q->tail = NULL;
-    return q;
+static uint32_t characterKey(char *character) {
+    uint32_t key = 0;
+    for (int ix = 0; ix < MAX_CHARACTER_LEN && character[ix] != '\0'; ix++) {
+        key |= (uint32_t)(unsigned char)character[ix] << (8 * ix);
+    }
+    return key;
 }
 
-// insert item in queue.
-// performance: O(1)
-static void queueInsert(struct queue *q, void *item) {
-    struct node *qNode = malloc(sizeof(struct node));
-    qNode->content = item;
-    qNode->next = NULL;
-    // if head is NULL, then tail is also NULL
-    // therefore the list is empty.
-    if (q->head == NULL) {
-        q->head = qNode;
-        q->tail = qNode;
-    } else {
-        q->tail->next = qNode;
-        q->tail = q->tail->next;
+// record count occurrences of the character with the given key.
+// performance: O(1) amortised
+static void addCount(Counter c, uint32_t key, unsigned int count) {
+    if (key < 128) {
+        if (c->ascii[key] == 0) {
+            c->numItems++;
+        }
+        c->ascii[key] += count;
+        return;
     }
-}
 
-// remove the first item in queue.
-// note that popped item must be freed manually.
-// performance: O(1)
-static struct node *queuePop(struct queue *q) {
-    struct node *popped = q->head;
-    q->head = q->head->next;
-    return popped;
+    struct slot *slot = findSlot(c, key);
+    if (slot->key == 0) {
+        // keep the table at most half full
+        if (2 * (c->slotsUsed + 1) > (1 << c->slotBits)) {
+            growSlots(c);
+            slot = findSlot(c, key);
+        }
+        slot->key = key;
+        c->slotsUsed++;
+        c->numItems++;
+    }
+    slot->count += count;
 }
 
-// check if queue is empty.
-// performance: O(1)
-static bool queueIsEmpty(struct queue *q) { return q->head == NULL; }
+// find the slot holding key, or the unused slot it would go in.
+// performance: O(1) expected
+static struct slot *findSlot(Counter c, uint32_t key) {
+    uint32_t mask = (1u << c->slotBits) - 1;
+    uint32_t ix = (key * 0x9E3779B1u) >> (32 - c->slotBits);
+    while (c->slots[ix].key != 0 && c->slots[ix].key != key) {
+        ix = (ix + 1) & mask;
+    }
+    return &c->slots[ix];
+}
 
-// free queue
-// queue must be empty, otherwise crash
-// performance: O(1)
-static void queueFree(struct queue *q) {
-    assert(q->head == NULL);
-    free(q);
+// double the number of slots, moving every used slot over.
+// performance: O(n)
+static void growSlots(Counter c) {
+    struct slot *old = c->slots;
+    int oldSize = 1 << c->slotBits;
+    c->slotBits++;
+    c->slots = calloc(1 << c->slotBits, sizeof(struct slot));
+    for (int ix = 0; ix < oldSize; ix++) {
+        if (old[ix].key != 0) {
+            *findSlot(c, old[ix].key) = old[ix];
+        }
+    }
+    free(old);
 }
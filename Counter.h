@@ -30,6 +30,12 @@ void CounterFree(Counter c);
  */
 void CounterAdd(Counter c, char *character);
 
+/**
+ * Adds the occurrences of every character in other to the counter,
+ * leaving other unchanged
+ */
+void CounterMerge(Counter c, Counter other);
+
 /**
  * Returns the number of distinct characters added to the counter
  */
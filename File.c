@@ -6,9 +6,15 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "File.h"
 
+// files open for reading are read in blocks of this many bytes
+#define READ_BUFFER_LEN 65536
+
 typedef enum {
 	READ,
 	WRITE,
@@ -17,8 +23,16 @@ typedef enum {
 struct file {
 	FILE *fp;
 	Mode mode;
+	char *buffer; // bytes read ahead (read mode only)
+	size_t pos;   // next unread byte in buffer
+	size_t len;   // number of bytes in buffer
+	bool mapped;   // whether buffer maps the whole file
+	bool resident; // whether buffer holds the whole file
 };
 
+static bool mapFile(File file);
+static bool fillBuffer(File file, size_t need);
+
 File FileOpenToRead(char *filename) {
 	File file = malloc(sizeof(*file));
 	if (file == NULL) {
@@ -33,6 +47,18 @@ File FileOpenToRead(char *filename) {
 	}
 
 	file->mode = READ;
+	file->pos = 0;
+	file->len = 0;
+	file->mapped = mapFile(file);
+	file->resident = file->mapped;
+	if (!file->mapped) {
+		// not a regular file (e.g., a pipe), so fall back to stdio
+		file->buffer = malloc(READ_BUFFER_LEN);
+		if (file->buffer == NULL) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 	return file;
 }
 
@@ -50,47 +76,186 @@ File FileOpenToWrite(char *filename) {
 	}
 
 	file->mode = WRITE;
+	file->buffer = NULL;
+	file->pos = 0;
+	file->len = 0;
+	file->mapped = false;
+	file->resident = false;
+	return file;
+}
+
+File FileOpenToReread(char *filename) {
+	File file = FileOpenToRead(filename);
+	if (file->resident) {
+		return file;
+	}
+
+	// can't map it, so read the rest of it into memory
+	size_t capacity = READ_BUFFER_LEN;
+	while (true) {
+		if (file->len == capacity) {
+			capacity *= 2;
+			char *resize = realloc(file->buffer, capacity);
+			if (resize == NULL) {
+				fprintf(stderr, "error: out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+			file->buffer = resize;
+		}
+		size_t n = fread(&file->buffer[file->len], 1, capacity - file->len,
+		                 file->fp);
+		if (n == 0) {
+			break;
+		}
+		file->len += n;
+	}
+	file->resident = true;
 	return file;
 }
 
 void FileClose(File file) {
+	if (file->mapped) {
+		munmap(file->buffer, file->len);
+	} else {
+		free(file->buffer);
+	}
 	fclose(file->fp);
 	free(file);
 }
 
 bool FileReadCharacter(File file, char buffer[]) {
+	char *character;
+	int len = FileNextCharacter(file, &character);
+	if (len == 0) {
+		return false;
+	}
+
+	memcpy(buffer, character, len);
+	buffer[len] = '\0';
+	return true;
+}
+
+int FileNextCharacter(File file, char **character) {
 	assert(file->mode == READ);
 
-	int ch = fgetc(file->fp);
-	if (ch == EOF) {
-		return false;
+	if (file->pos == file->len && !fillBuffer(file, 1)) {
+		return 0;
 	}
 
-	ungetc(ch, file->fp);
-	char byte1 = (char) ch;
+	unsigned char byte1 = file->buffer[file->pos];
+	int len = 1;
+	if (byte1 >= 0x80) {
+		len = FileCharacterLength(byte1);
+		if (len == 0 ||
+		    (file->len - file->pos < (size_t)len && !fillBuffer(file, len))) {
+			fprintf(stderr, "error: invalid character\n");
+			return 0;
+		}
+	}
+
+	*character = &file->buffer[file->pos];
+	file->pos += len;
+	return len;
+}
+
+size_t FileReadBytes(File file, char *buffer, size_t len) {
+	assert(file->mode == READ);
 
-	int len;
+	// hand over anything that has been read ahead first
+	size_t buffered = file->len - file->pos;
+	if (buffered > len) {
+		buffered = len;
+	}
+	memcpy(buffer, &file->buffer[file->pos], buffered);
+	file->pos += buffered;
+	if (file->resident) {
+		return buffered;
+	}
+	return buffered + fread(buffer + buffered, 1, len - buffered, file->fp);
+}
+
+char *FileReadRest(File file, size_t *size) {
+	assert(file->mode == READ);
+
+	if (!file->resident) {
+		return NULL;
+	}
+	char *rest = &file->buffer[file->pos];
+	*size = file->len - file->pos;
+	file->pos = file->len;
+	return rest;
+}
+
+void FileRewind(File file) {
+	assert(file->mode == READ && file->resident);
+
+	file->pos = 0;
+}
+
+void FileWrite(File file, char *str) {
+	assert(file->mode == WRITE);
+
+	fputs(str, file->fp);
+}
+
+void FileWriteBytes(File file, char *bytes, size_t len) {
+	assert(file->mode == WRITE);
+
+	fwrite(bytes, 1, len, file->fp);
+}
+
+int FileCharacterLength(unsigned char byte1) {
 	if ((0b10000000 & byte1) == 0) {
-		len = 1;
+		return 1;
 	} else if ((0b11100000 & byte1) == 0b11000000) {
-		len = 2;
+		return 2;
 	} else if ((0b11110000 & byte1) == 0b11100000) {
-		len = 3;
+		return 3;
 	} else if ((0b11111000 & byte1) == 0b11110000) {
-		len = 4;
+		return 4;
 	} else {
-		fprintf(stderr, "error: invalid character\n");
+		return 0;
+	}
+}
+
+// map a regular, non-empty file into memory in its entirety,
+// so that reading it needs no copies. returns false if it can't be.
+static bool mapFile(File file) {
+	struct stat st;
+	if (fstat(fileno(file->fp), &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size == 0) {
 		return false;
 	}
 
-	fread(buffer, 1, len, file->fp);
-	buffer[len] = '\0';
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+	                 fileno(file->fp), 0);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	file->buffer = map;
+	file->len = st.st_size;
 	return true;
 }
 
-void FileWrite(File file, char *str) {
-	assert(file->mode == WRITE);
+// make sure at least need bytes are buffered, keeping any that have not
+// been read yet. returns false if the end of the file comes first.
+static bool fillBuffer(File file, size_t need) {
+	if (file->resident) {
+		return file->len - file->pos >= need;
+	}
 
-	fprintf(file->fp, "%s", str);
+	size_t left = file->len - file->pos;
+	memmove(file->buffer, &file->buffer[file->pos], left);
+	file->pos = 0;
+	file->len = left;
+	while (file->len < need) {
+		size_t n = fread(&file->buffer[file->len], 1,
+		                 READ_BUFFER_LEN - file->len, file->fp);
+		if (n == 0) {
+			return false;
+		}
+		file->len += n;
+	}
+	return true;
 }
-
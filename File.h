@@ -6,6 +6,7 @@
 #define FILE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "character.h"
 
@@ -18,6 +19,14 @@ typedef struct file *File;
  */
 File FileOpenToRead(char *filename);
 
+/**
+ * Opens a file for reading, like FileOpenToRead, such that it can be
+ * read again from the start with FileRewind. Regular files are mapped
+ * into memory, and other files (e.g., pipes) are read into memory in
+ * full.
+ */
+File FileOpenToReread(char *filename);
+
 /**
  * Opens a file for writing.
  * If there is no file with the given name, it will be created.
@@ -50,6 +59,54 @@ void FileClose(File file);
  */
 bool FileReadCharacter(File file, char buffer[]);
 
+/**
+ * Reads a character from the file without copying it, setting
+ * *character to point at its bytes. The bytes are not followed by a
+ * terminating null byte ('\0'), and are only valid until the next read
+ * from the file.
+ *
+ * Reads characters sequentially, like FileReadCharacter, and the two
+ * may be mixed.
+ *
+ * Assumes that the file is open for reading.
+ * Returns the length of the character in bytes, or 0 if no character
+ * was read (e.g., if the end of the file was reached).
+ */
+int FileNextCharacter(File file, char **character);
+
+/**
+ * Reads up to len bytes from the file into the given buffer, without
+ * adding a terminating null byte ('\0').
+ *
+ * Calling this function multiple times on a file will cause it to read
+ * the file sequentially.
+ *
+ * Assumes that the file is open for reading.
+ * Returns the number of bytes read, which is less than len only at the
+ * end of the file.
+ */
+size_t FileReadBytes(File file, char *buffer, size_t len);
+
+/**
+ * Reads the rest of the file without copying it, if the whole file is
+ * held in memory (i.e., it is a regular file or was opened with
+ * FileOpenToReread). Sets *size to the number of bytes read.
+ *
+ * Assumes that the file is open for reading.
+ * Returns a pointer to the bytes read, which stay valid until the file
+ * is closed, or NULL if the file is not held in memory, in which case
+ * nothing is read.
+ */
+char *FileReadRest(File file, size_t *size);
+
+/**
+ * Moves back to the start of the file, so that the next read reads the
+ * first character again.
+ *
+ * Assumes that the file was opened with FileOpenToReread.
+ */
+void FileRewind(File file);
+
 /**
  * Writes a string to the file.
  * The string will be written to the end of the file (i.e., after all
@@ -60,4 +117,18 @@ bool FileReadCharacter(File file, char buffer[]);
  */
 void FileWrite(File file, char *str);
 
+/**
+ * Writes len bytes to the file.
+ * Unlike FileWrite, the bytes may contain null bytes ('\0').
+ *
+ * Assumes that the file is open for writing.
+ */
+void FileWriteBytes(File file, char *bytes, size_t len);
+
+/**
+ * Returns the number of bytes in a character, given its first byte, or
+ * 0 if the byte cannot start a character.
+ */
+int FileCharacterLength(unsigned char byte1);
+
 #endif
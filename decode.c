@@ -2,128 +2,125 @@
 
 // !!! DO NOT MODIFY THIS FILE !!!
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "character.h"
 #include "File.h"
 #include "huffman.h"
 
-static struct huffmanTree *readHuffmanTree(char *filename);
-static struct huffmanTree *readTree(FILE *fp, char buffer[]);
-static struct huffmanTree *newHuffmanNode(char *character, int freq);
-static void freeHuffmanTree(struct huffmanTree *t);
+static void decodeBatch(char *listFilename, char *treeFilename);
 
-static char *readEncoding(char *filename);
+static bool parseRange(char *range, size_t *from, size_t *to);
+static void usage(char *progName);
 
 int main(int argc, char *argv[]) {
-	if (argc != 4) {
-		fprintf(stderr, "usage: %s <tree filename> <encoding filename> "
-		        "<output filename>\n",
-		        argv[0]);
-		exit(EXIT_FAILURE);
-	}
-
-	struct huffmanTree *tree = readHuffmanTree(argv[1]);
-	char *encoding = readEncoding(argv[2]);
-
-	decode(tree, encoding, argv[3]);
-
-	freeHuffmanTree(tree);
-	free(encoding);
-}
-
-static struct huffmanTree *readHuffmanTree(char *filename) {
-	FILE *fp = fopen(filename, "r");
-	if (fp == NULL) {
-		fprintf(stderr, "error: failed to open '%s' for reading\n", filename);
-		exit(EXIT_FAILURE);
+	char *indexFilename = NULL;
+	char *listFilename = NULL;
+	size_t from = 0;
+	size_t to = SIZE_MAX;
+	bool ranged = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:j:m:r:")) != -1) {
+		switch (opt) {
+			case 'i': indexFilename = optarg; break;
+			case 'j': setHuffmanThreads(atoi(optarg)); break;
+			case 'm': listFilename = optarg; break;
+			case 'r':
+				ranged = true;
+				if (!parseRange(optarg, &from, &to)) {
+					usage(argv[0]);
+				}
+				break;
+			default: usage(argv[0]);
+		}
 	}
 
-	char buffer[MAX_CHARACTER_LEN + 1];
-	struct huffmanTree *tree = readTree(fp, buffer);
-	fclose(fp);
-	return tree;
-}
-
-static struct huffmanTree *readTree(FILE *fp, char buffer[]) {
-	struct huffmanTree *t = newHuffmanNode(NULL, 0);
-
-	int c = fgetc(fp);
-
-	if (c == '(') {
-		t->left = readTree(fp, buffer);
-		fgetc(fp); // should always be a ','
-		t->right = readTree(fp, buffer);
-		fgetc(fp); // should always be a ')'
-	} else {
-		int i = 0;
-		while (c != ',' && c != ')') {
-			if (c == '\\') {
-				c = fgetc(fp);
-			}
-			buffer[i++] = c;
-			c = fgetc(fp);
+	char *progName = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (listFilename != NULL) {
+		if (argc != 2 || indexFilename != NULL || ranged) {
+			usage(progName);
 		}
-
-		ungetc(c, fp);
-		buffer[i] = '\0';
-		t->character = strdup(buffer);
+		decodeBatch(listFilename, argv[1]);
+		return 0;
+	}
+	if (argc != 4 || (ranged && indexFilename == NULL)) {
+		usage(progName);
 	}
 
-	return t;
-}
+	HuffmanModel model = HuffmanModelRead(argv[1]);
+	File out = FileOpenToWrite(argv[3]);
 
-static struct huffmanTree *newHuffmanNode(char *character, int freq) {
-	struct huffmanTree *new = malloc(sizeof(struct huffmanTree));
-	if (new == NULL) {
-		fprintf(stderr, "error: out of memory\n");
-		exit(EXIT_FAILURE);
+	if (indexFilename == NULL) {
+		File in = FileOpenToRead(argv[2]);
+		HuffmanModelDecode(model, in, out);
+		FileClose(in);
+	} else {
+		File in = FileOpenToReread(argv[2]);
+		File index = FileOpenToReread(indexFilename);
+		HuffmanModelDecodeIndexed(model, in, index, out, from, to);
+		FileClose(index);
+		FileClose(in);
 	}
 
-	new->character = character;
-	new->freq = freq;
-	new->left = NULL;
-	new->right = NULL;
-	return new;
+	FileClose(out);
+	HuffmanModelFree(model);
 }
 
-static void freeHuffmanTree(struct huffmanTree *t) {
-	if (t != NULL) {
-		freeHuffmanTree(t->left);
-		freeHuffmanTree(t->right);
-		free(t->character);
-		free(t);
+// decode every encoding named in a list file with the model of one tree
+// file. each line of the list holds an encoding filename followed by the
+// filename to write its text to.
+static void decodeBatch(char *listFilename, char *treeFilename) {
+	HuffmanModel model = HuffmanModelRead(treeFilename);
+	BatchList list = BatchListOpen(listFilename);
+	char *names[2];
+	while (BatchListNext(list, names)) {
+		File in = FileOpenToRead(names[0]);
+		File out = FileOpenToWrite(names[1]);
+		HuffmanModelDecode(model, in, out);
+		FileClose(out);
+		FileClose(in);
 	}
+	BatchListClose(list);
+	HuffmanModelFree(model);
 }
 
-////////////////////////////////////////////////////////////////////////
-
-static char *readEncoding(char *filename) {
-	FILE *fp = fopen(filename, "r");
-	if (fp == NULL) {
-		fprintf(stderr, "error: failed to open '%s' for reading\n", filename);
-		exit(EXIT_FAILURE);
+// parse a range of the form from:to, where either end may be left out
+static bool parseRange(char *range, size_t *from, size_t *to) {
+	char *end;
+	*from = strtoull(range, &end, 10);
+	if (*end != ':') {
+		return false;
 	}
-
-	fseek(fp, 0, SEEK_END);
-	long pos = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-
-	char *encoding = malloc((pos + 1) * sizeof(char));
-	if (encoding == NULL) {
-		fprintf(stderr, "error: out of memory\n");
-		exit(EXIT_FAILURE);
-	}
-
-	if (fscanf(fp, "%s", encoding) != 1) {
-		fprintf(stderr, "error: failed to read encoding\n");
-		exit(EXIT_FAILURE);
+	char *rest = end + 1;
+	if (*rest != '\0') {
+		*to = strtoull(rest, &end, 10);
+		return *end == '\0';
 	}
-
-	fclose(fp);
-	return encoding;
+	return true;
 }
 
-////////////////////////////////////////////////////////////////////////
+static void usage(char *progName) {
+	fprintf(stderr,
+	        "usage: %s [-i index filename [-r from:to]] [-j threads] "
+	        "<tree filename> <encoding filename> <output filename>\n"
+	        "       %s [-j threads] -m <list filename> <tree filename>\n"
+	        "  -i  decode using the block index written by encode -i,\n"
+	        "      on several threads\n"
+	        "  -r  only decode bytes from up to (but not including) to of\n"
+	        "      the text, where either may be left out\n"
+	        "  -m  decode every encoding in the list with the same tree,\n"
+	        "      where each line holds an encoding filename and an\n"
+	        "      output filename\n"
+	        "  -j  number of threads to use, 0 (the default) for one per\n"
+	        "      processor\n",
+	        progName,
+	        progName);
+	exit(EXIT_FAILURE);
+}
@@ -2,109 +2,255 @@
 
 // !!! DO NOT MODIFY THIS FILE !!!
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "character.h"
 #include "File.h"
 #include "huffman.h"
 
-static struct huffmanTree *readHuffmanTree(char *filename);
-static struct huffmanTree *readTree(FILE *fp, char buffer[]);
-static struct huffmanTree *newHuffmanNode(char *character, int freq);
+// number of characters per block of a block index, unless set with -n
+#define DEFAULT_BLOCK_LEN 65536
 
 static void writeHuffmanTree(struct huffmanTree *tree, char *filename);
 static void writeTree(struct huffmanTree *t, FILE *fp);
-static void writeEncoding(char *encoding, char *filename);
+
+static void writeCanonicalCode(CanonicalCode code, char *filename);
 
 void showHuffmanTree(struct huffmanTree *t);
 static void freeHuffmanTree(struct huffmanTree *t);
 
+static struct huffmanTree *buildHuffmanTree(File in, int maxLength);
+static HuffmanModel buildTreeFile(File in, char *filename, bool bytes,
+                                  int maxLength, bool canonical,
+                                  bool precompiled);
+static HuffmanModel writeTreeFile(struct huffmanTree *tree, char *filename,
+                                  bool canonical, bool precompiled);
+static void writeModel(HuffmanModel model, char *filename);
+static void encodeBatch(char *listFilename, char *treeFilename,
+                        enum encodingFormat format);
+static void usage(char *progName);
+
 int main(int argc, char *argv[]) {
-	if (argc != 3 && argc != 4) {
-		fprintf(stderr,
-		        "usage: %s <input filename> <tree filename> "
-		        "[encoding filename]\n",
-		        argv[0]);
-		exit(EXIT_FAILURE);
+	enum encodingFormat format = ENCODING_PACKED;
+	bool build = false;
+	bool canonical = false;
+	bool precompiled = false;
+	bool bytes = false;
+	char *indexFilename = NULL;
+	char *listFilename = NULL;
+	int blockLen = DEFAULT_BLOCK_LEN;
+	int maxLength = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "abci:j:l:m:n:pr")) != -1) {
+		switch (opt) {
+			case 'a': format = ENCODING_TEXT; break;
+			case 'b': build = true; break;
+			case 'c': canonical = true; break;
+			case 'i': indexFilename = optarg; break;
+			case 'j': setHuffmanThreads(atoi(optarg)); break;
+			case 'l':
+				maxLength = atoi(optarg);
+				if (maxLength < 1) {
+					usage(argv[0]);
+				}
+				break;
+			case 'm': listFilename = optarg; break;
+			case 'n': blockLen = atoi(optarg); break;
+			case 'p': precompiled = true; break;
+			case 'r': bytes = true; break;
+			default: usage(argv[0]);
+		}
 	}
 
-	if (argc == 3) {
-		struct huffmanTree *tree = createHuffmanTree(argv[1]);
-		if (tree == NULL) {
-			fprintf(stderr,
-			        "error: createHuffmanTree returned an empty tree\n");
-			exit(EXIT_FAILURE);
+	char *progName = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (listFilename != NULL) {
+		if (argc != 2 || build || canonical || precompiled || bytes ||
+		    maxLength > 0 || indexFilename != NULL) {
+			usage(progName);
 		}
-		writeHuffmanTree(tree, argv[2]);
-		freeHuffmanTree(tree);
-	} else {
-		struct huffmanTree *tree = readHuffmanTree(argv[2]);
-		char *encoding = encode(tree, argv[1]);
-		writeEncoding(encoding, argv[3]);
-		free(encoding);
-		freeHuffmanTree(tree);
+		encodeBatch(listFilename, argv[1], format);
+		return 0;
+	}
+	if ((argc != 3 && argc != 4) || (build && argc != 4) ||
+	    ((canonical || precompiled || bytes || maxLength > 0) &&
+	     argc == 4 && !build) ||
+	    (canonical && precompiled) || (bytes && (canonical || maxLength > 0)) ||
+	    (indexFilename != NULL && argc != 4) || blockLen < 1) {
+		usage(progName);
 	}
-}
 
-////////////////////////////////////////////////////////////////////////
+	if (argc == 3) {
+		File in = FileOpenToRead(argv[1]);
+		HuffmanModel model = buildTreeFile(in, argv[2], bytes, maxLength,
+		                                   canonical, precompiled);
+		FileClose(in);
+		HuffmanModelFree(model);
+		return 0;
+	}
 
-static struct huffmanTree *readHuffmanTree(char *filename) {
-	FILE *fp = fopen(filename, "r");
-	if (fp == NULL) {
-		fprintf(stderr, "error: failed to open '%s' for reading\n", filename);
-		exit(EXIT_FAILURE);
+	HuffmanModel model;
+	File in;
+	if (build) {
+		// the input is mapped or kept in memory, so it is only read once
+		in = FileOpenToReread(argv[1]);
+		model = buildTreeFile(in, argv[2], bytes, maxLength, canonical,
+		                      precompiled);
+		FileRewind(in);
+	} else {
+		model = HuffmanModelRead(argv[2]);
+		in = FileOpenToRead(argv[1]);
 	}
 
-	char buffer[MAX_CHARACTER_LEN + 1];
-	struct huffmanTree *tree = readTree(fp, buffer);
-	fclose(fp);
-	return tree;
+	File out = FileOpenToWrite(argv[3]);
+	File index = NULL;
+	if (indexFilename != NULL) {
+		index = FileOpenToWrite(indexFilename);
+	}
+	HuffmanModelEncode(model, in, out, format, index, blockLen);
+	if (index != NULL) {
+		FileClose(index);
+	}
+	FileClose(out);
+	FileClose(in);
+	HuffmanModelFree(model);
 }
 
-static struct huffmanTree *readTree(FILE *fp, char buffer[]) {
-	struct huffmanTree *t = newHuffmanNode(NULL, 0);
+// build the code of the rest of in, either a byte code or a huffman
+// tree with codes of at most maxLength bits (unless it is 0), and write
+// it to filename. returns the model of the codes written.
+static HuffmanModel buildTreeFile(File in, char *filename, bool bytes,
+                                  int maxLength, bool canonical,
+                                  bool precompiled) {
+	if (bytes) {
+		CanonicalCode code = CanonicalCodeNewBytes(in);
+		HuffmanModel model = HuffmanModelNewCanonical(code);
+		if (precompiled) {
+			writeModel(model, filename);
+		} else {
+			writeCanonicalCode(code, filename);
+		}
+		CanonicalCodeFree(code);
+		return model;
+	}
 
-	int c = fgetc(fp);
+	struct huffmanTree *tree = buildHuffmanTree(in, maxLength);
+	HuffmanModel model =
+	    writeTreeFile(tree, filename, canonical, precompiled);
+	freeHuffmanTree(tree);
+	return model;
+}
 
-	if (c == '(') {
-		t->left = readTree(fp, buffer);
-		fgetc(fp); // should always be a ','
-		t->right = readTree(fp, buffer);
-		fgetc(fp); // should always be a ')'
+// write tree to filename as a canonical code, a precompiled model or
+// a whole tree, returning the model of the codes written
+static HuffmanModel writeTreeFile(struct huffmanTree *tree, char *filename,
+                                  bool canonical, bool precompiled) {
+	HuffmanModel model;
+	if (canonical) {
+		CanonicalCode code = CanonicalCodeNew(tree);
+		writeCanonicalCode(code, filename);
+		model = HuffmanModelNewCanonical(code);
+		CanonicalCodeFree(code);
+	} else if (precompiled) {
+		model = HuffmanModelNew(tree);
+		writeModel(model, filename);
 	} else {
-		int i = 0;
-		while (c != ',' && c != ')') {
-			if (c == '\\') {
-				c = fgetc(fp);
-			}
-			buffer[i++] = c;
-			c = fgetc(fp);
-		}
-
-		ungetc(c, fp);
-		buffer[i] = '\0';
-		t->character = strdup(buffer);
+		writeHuffmanTree(tree, filename);
+		model = HuffmanModelNew(tree);
 	}
-
-	return t;
+	return model;
 }
 
-static struct huffmanTree *newHuffmanNode(char *character, int freq) {
-	struct huffmanTree *new = malloc(sizeof(struct huffmanTree));
-	if (new == NULL) {
-		fprintf(stderr, "error: out of memory\n");
+// build the tree for the rest of in, limiting codes to maxLength bits
+// unless it is 0, in which case the cost of the limit is reported
+static struct huffmanTree *buildHuffmanTree(File in, int maxLength) {
+	struct huffmanTree *tree;
+	if (maxLength == 0) {
+		tree = createHuffmanTreeStream(in);
+	} else {
+		uint64_t optimalBits;
+		uint64_t limitedBits;
+		tree = createLimitedHuffmanTreeStream(in, maxLength, &optimalBits,
+		                                      &limitedBits);
+		double loss = optimalBits == 0
+		                  ? 0
+		                  : 100.0 * (limitedBits - optimalBits) / optimalBits;
+		printf("codes limited to %d bits: %llu bits instead of %llu "
+		       "(%.3f%% larger)\n",
+		       maxLength, (unsigned long long)limitedBits,
+		       (unsigned long long)optimalBits, loss);
+	}
+	if (tree == NULL) {
+		fprintf(stderr, "error: createHuffmanTree returned an empty tree\n");
 		exit(EXIT_FAILURE);
 	}
+	return tree;
+}
+
+// encode every input named in a list file with the model of one tree
+// file. each line of the list holds an input filename followed by the
+// filename to write its encoding to.
+static void encodeBatch(char *listFilename, char *treeFilename,
+                        enum encodingFormat format) {
+	HuffmanModel model = HuffmanModelRead(treeFilename);
+	BatchList list = BatchListOpen(listFilename);
+	char *names[2];
+	while (BatchListNext(list, names)) {
+		File in = FileOpenToRead(names[0]);
+		File out = FileOpenToWrite(names[1]);
+		HuffmanModelEncode(model, in, out, format, NULL, 0);
+		FileClose(out);
+		FileClose(in);
+	}
+	BatchListClose(list);
+	HuffmanModelFree(model);
+}
 
-	new->character = character;
-	new->freq = freq;
-	new->left = NULL;
-	new->right = NULL;
-	return new;
+static void usage(char *progName) {
+	fprintf(stderr,
+	        "usage: %s [-c | -p] [-j threads] [-l bits | -r] <input filename> "
+	        "<tree filename>\n"
+	        "       %s [-a] [-j threads] [-i index filename [-n characters]] "
+	        "<input filename> <tree filename> <encoding filename>\n"
+	        "       %s [-a] [-c | -p] [-j threads] [-l bits | -r] "
+	        "[-i index filename [-n characters]] -b <input filename> "
+	        "<tree filename> "
+	        "<encoding filename>\n"
+	        "       %s [-a] [-j threads] -m <list filename> <tree filename>\n"
+	        "  -a  write the encoding as text, one '0' or '1' per bit\n"
+	        "  -b  build the tree from the input and write it as well as\n"
+	        "      the encoding, reading the input once\n"
+	        "  -c  write the tree as a canonical code, which only holds the\n"
+	        "      code length of each character\n"
+	        "  -p  write the tree as a precompiled model, which is loaded\n"
+	        "      without being parsed, but only on the same kind of machine\n"
+	        "  -r  treat every byte of the input as a symbol rather than\n"
+	        "      every UTF-8 character, so any file can be encoded, and\n"
+	        "      write the tree as a byte code (not with -c or -l)\n"
+	        "  -l  limit codes to at most this many bits, and report how\n"
+	        "      much longer the encoding gets\n"
+	        "  -i  also write a block index of the encoding, for decode -i\n"
+	        "  -n  number of characters per block of the index (default %d)\n"
+	        "  -m  encode every input in the list with the same tree,\n"
+	        "      where each line holds an input filename and an\n"
+	        "      encoding filename\n"
+	        "  -j  number of threads to use, 0 (the default) for one per\n"
+	        "      processor\n",
+	        progName,
+	        progName,
+	        progName,
+	        progName,
+	        DEFAULT_BLOCK_LEN);
+	exit(EXIT_FAILURE);
 }
 
+////////////////////////////////////////////////////////////////////////
+
 static void freeHuffmanTree(struct huffmanTree *t) {
 	if (t != NULL) {
 		freeHuffmanTree(t->left);
@@ -155,15 +301,16 @@ static void writeTree(struct huffmanTree *t, FILE *fp) {
 
 ////////////////////////////////////////////////////////////////////////
 
-static void writeEncoding(char *encoding, char *filename) {
-	FILE *fp = fopen(filename, "w");
-	if (fp == NULL) {
-		fprintf(stderr, "error: failed to open '%s' for writing\n", filename);
-		exit(EXIT_FAILURE);
-	}
+static void writeCanonicalCode(CanonicalCode code, char *filename) {
+	File file = FileOpenToWrite(filename);
+	CanonicalCodeWrite(code, file);
+	FileClose(file);
+}
 
-	fprintf(fp, "%s", encoding);
-	fclose(fp);
+static void writeModel(HuffmanModel model, char *filename) {
+	File file = FileOpenToWrite(filename);
+	HuffmanModelWrite(model, file);
+	FileClose(file);
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -9,10 +9,13 @@
 // Completed by Michael Stephen Lape (z5477893@ad.unsw.edu.au)
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "Counter.h"
 #include "File.h"
@@ -21,142 +24,677 @@
 
 #define ENCODING_0   '0'
 #define ENCODING_1   '1'
-#define ENCODING_END '\0'
+
+// packed encodings start with PACKED_MAGIC, followed by the bits 8 to
+// a byte, and end with a byte holding the number of bits used in the
+// last byte before it (0 if there are none). nothing needs to be filled
+// in afterwards, so encodings can be written to pipes.
+#define PACKED_MAGIC     "HUFP"
+#define PACKED_MAGIC_LEN 4
+
+// block indexes start with INDEX_MAGIC, followed by the number of
+// characters per block and the number of entries, then the entries.
+// everything is stored as 64 bit little endian integers.
+#define INDEX_MAGIC      "HUFI"
+#define INDEX_MAGIC_LEN  4
+#define INDEX_HEADER_LEN 20
+#define INDEX_ENTRY_LEN  24
+
+// canonical codes are stored as CANONICAL_MAGIC, followed by each
+// character in canonical order, as a byte holding its code length
+// followed by its bytes.
+#define CANONICAL_MAGIC     "HUFC"
+#define CANONICAL_MAGIC_LEN 4
+
+// byte codes are stored as BYTE_CODE_MAGIC, followed by a byte for each
+// of the 256 bytes, holding its code length plus 1, or 0 if it does not
+// appear
+#define BYTE_CODE_MAGIC "HUFB"
+#define BYTE_SYMBOLS    256
+
+// model files start with a struct modelHeader, whose magic is
+// MODEL_MAGIC and whose byteOrder is MODEL_BYTE_ORDER as stored by the
+// machine that wrote it.
+#define MODEL_MAGIC      "HUFM"
+#define MODEL_MAGIC_LEN  4
+#define MODEL_BYTE_ORDER 0x01020304
+
+// arenas hand out memory from blocks of at least this many bytes,
+// in multiples of ARENA_ALIGN bytes
+#define ARENA_BLOCK_LEN 65536
+#define ARENA_ALIGN     8
+
+// encodings are written out and read in chunks of this many bytes
+#define WRITE_CHUNK_LEN 65536
+#define READ_CHUNK_LEN  65536
+
+// inputs are only split between threads in pieces of at least this size
+#define MIN_THREAD_CHUNK_LEN (1 << 20)
+
+// when encoding on several threads, each thread takes a piece of at most
+// this size at a time, so that only that much encoding is held in memory
+#define ENCODE_THREAD_CHUNK_LEN (4 << 20)
+
+// when decoding on several threads, each thread takes whole blocks
+// adding up to about this much text at a time
+#define DECODE_THREAD_CHUNK_LEN (4 << 20)
+
+// keys below this, i.e. single bytes, are looked up in code tables
+// directly rather than hashed
+#define DIRECT_KEYS 256
+
+// number of bits used to index the root decode table.
+// codes longer than this continue into subtables.
+#define DECODE_BITS 11
+
+// maximum number of output bytes held by a decode table entry
+#define DECODE_OUT_LEN 9
+
+// codes longer than 64 bits are held in chunks of 64 bits.
+// codes of at most this many chunks are put without allocating.
+#define LOCAL_CHUNKS 64
+#define NO_CHUNK     UINT32_MAX
 
 // INTERNAL DATA STRUCTURES
 
-// a linked list for storing multiple huffman trees
-// the list is sorted in ascending order when the tree is added.
-// this is used to create the full huffman tree.
-struct huffmanTreeArena {
-	struct huffmanTreeArenaNode *head;
+// a bump allocator for temporary data, all of which is freed at once.
+// memory is carved off the front of the newest block, and a new block
+// is started when it runs out.
+struct arena {
+	struct arenaBlock *blocks;
+	char *next;
+	size_t left;
+};
+
+struct arenaBlock {
+	struct arenaBlock *prev;
+	uint64_t memory[]; // keeps the memory aligned
+};
+
+// a binary min-heap of huffman trees, used to create the full huffman tree.
+// trees are ordered by frequency, then by the order they were added in,
+// so that trees of equal frequency are merged first come, first served.
+struct huffmanHeap {
+	struct huffmanHeapEntry *entries;
 	int size;
+	int added;
 };
 
-struct huffmanTreeArenaNode {
-	struct huffmanTreeArenaNode *next;
+struct huffmanHeapEntry {
 	struct huffmanTree *tree;
+	int order;
 };
 
-// a unit structure relating a character to its corresponding encoding
-struct charEncoding {
-	char *character;
-	char *code;
+// an item of a package-merge list: either a character (its index in
+// the counted items), or a package of two items of the list before,
+// where symbol is -1.
+struct mergeItem {
+	uint64_t weight;
+	int symbol;
+};
+
+// a piece of the input counted by one thread
+struct countJob {
+	char *text;
+	size_t len;
+	Counter counter;
+	bool valid; // whether every character in the piece was valid
+};
+
+// a piece of the input encoded by one thread.
+// the piece's encoding is first measured, then written starting at bit
+// start of out. the byte holding that bit is shared with the previous
+// piece, so it is kept in head rather than written.
+struct encodeJob {
+	struct codeTable *table;
+	char *text;
+	size_t len;
+	bool valid; // whether every character in the piece was valid
+	uint64_t bitCount;
+	uint64_t symbols; // number of characters in the piece
+	unsigned char *out;
+	uint64_t start;
+	unsigned char head;
+	struct blockIndex *index; // blocks starting in the piece, or NULL
+};
+
+// a run of blocks decoded by one thread into out
+struct decodeJob {
+	struct decoder *dec;
+	char *encoding;
+	size_t len;
+	struct blockEntry *start;
+	struct blockEntry *end;
+	char *out;
+};
+
+// where a block starts, as a bit of the encoding (not counting the
+// magic) and as a character and a byte of the text
+struct blockEntry {
+	uint64_t bit;
+	uint64_t symbol;
+	uint64_t byte;
+};
+
+// a block index, filled in as the text is encoded.
+// an entry is added at the start of every blockLen'th character,
+// and a last one marks the end of the encoding.
+struct blockIndex {
+	struct blockEntry *entries;
+	size_t count;
+	size_t capacity;
+	uint64_t blockLen;
+	uint64_t symbols;   // number of characters encoded so far
+	uint64_t bytes;     // number of bytes of text encoded so far
+	uint64_t blockLeft; // characters left before the next block starts
+};
+
+// a huffman tree flattened into one array, in preorder, so that the
+// left child of a node is the node after it. leaves hold their character
+// inline, and have no children (index 0, as the root is no child).
+struct flatNode {
+	uint32_t left;
+	uint32_t right;
+	uint32_t height; // length of the longest path down to a leaf
+	uint8_t len;     // number of bytes in character
+	char character[MAX_CHARACTER_LEN];
 };
 
-// linked-list representation of a code prefix.
-typedef struct prefixNode {
-	char dir;
-	char *finalChar;
-	struct prefixNode *next;
-} PrefixNode;
+struct flatTree {
+	struct flatNode *nodes;
+	uint32_t count;
+};
 
-struct prefixPath {
-	PrefixNode *head;
-	PrefixNode *tail;
+// a node whose code is known, waiting to be visited.
+// bits holds the bits of the code after its last whole chunk, if it
+// has one.
+struct pendingCode {
+	uint32_t node;
+	uint64_t bits;
 	int length;
+	uint32_t chunk; // last whole chunk of the code, or NO_CHUNK
 };
 
-// a unit struct for performing level-order traversal of tree
-struct huffmanCrawler {
-	struct prefixPath *address;
+// a node waiting to be filled into the decode table at base, reached
+// by the first depth bits of the table's index (prefix)
+struct pendingFill {
+	uint32_t base;
+	int width;
+	uint32_t node;
+	int depth;
+	uint32_t prefix;
+};
+
+// a node waiting to be flattened, along with its parent's index if it is
+// a right child. left children are always flattened straight after their
+// parent.
+struct pendingNode {
 	struct huffmanTree *tree;
-	struct huffmanCrawler *next;
+	uint32_t parent;
+	bool right;
+};
+
+// a character of a canonical code.
+// its code is held in the low length bits of code.
+struct canonicalSymbol {
+	char character[MAX_CHARACTER_LEN + 1];
+	int len; // number of bytes in character
+	int length;
+	uint64_t code;
 };
 
-// data structure for managing level-order traversal of huffman tree
-struct huffmanTraverser {
-	struct huffmanCrawler *head;
-	struct huffmanCrawler *tail;
+// a canonical code, with its characters in canonical order:
+// by code length, then by character.
+struct canonicalCode {
+	struct canonicalSymbol *symbols;
+	int count;
+	bool bytes; // whether this is a byte code
 };
 
 // a simple buffer for storing very large strings
 struct buffer {
 	char *str;
-	unsigned int capacity;
-	unsigned int charCount;
+	size_t capacity;
+	size_t charCount;
 };
 
 // used for file encoding
 // rather than storing the character itself
-// we generate a unique value charSum to
-// refer to our character.
+// we pack its bytes into a key, which is unique
+// as characters are at most 4 bytes long.
+// the encoding is the low length bits of bits, unless it is longer
+// than 64 bits, in which case bits is the index of its last chunk.
 struct encoder {
-	int charSum;
-	unsigned int encodingLength;
-	char *encoding;
+	uint32_t key;
+	int length;
+	uint64_t bits;
+};
+
+// a chunk of a code longer than 64 bits.
+// such codes are split into chunks of 64 bits from their first bit,
+// the last of which may be shorter, and each chunk links to the one
+// before it, so codes with a common prefix share its chunks.
+// bits holds the chunk's bits in its low bits, and length is the length
+// of the code up to the end of the chunk.
+struct codeChunk {
+	uint64_t bits;
+	uint32_t prev; // NO_CHUNK for the first chunk of a code
+	uint32_t length;
+};
+
+// index from characters to their encoders.
+// single byte characters are looked up directly,
+// longer ones through an open addressed hash table.
+// unused entries have a length of -1.
+// the symbols of a byte code are bytes rather than characters.
+struct codeTable {
+	struct encoder *encoders;
+	int count;
+	struct encoder *direct; // DIRECT_KEYS entries, followed by the slots
+	struct encoder *slots;
+	uint32_t mask;
+	int hashBits;
+	bool bytes;
+	struct codeChunk *chunks; // chunks of codes longer than 64 bits
+	uint32_t chunkCount;
+};
+
+// reads an encoding as a stream of bits.
+// bits are buffered most significant bit first in acc,
+// so the next n bits can be looked at with a single shift.
+// the encoding is either text, with one '0' or '1' per bit,
+// or packed 8 bits to a byte. it is read from in a chunk at a time,
+// unless it is already entirely in memory (in is NULL).
+struct bitReader {
+	uint64_t acc;
+	int count;
+	bool packed;
+	File in;
+	char *bytes;
+	size_t pos;
+	size_t len;
+	bool sized;        // whether the end of a packed encoding was found
+	uint64_t bitsLeft; // bits not yet buffered, once sized (packed only)
+};
+
+// writes an encoding to a file in either format.
+// packed bits are gathered most significant bit first in acc and
+// moved into bytes a whole word at a time. bytes are written to the
+// file whenever a chunk fills up, so memory use stays fixed.
+struct bitWriter {
+	uint64_t acc;
+	int count;
+	uint64_t bitCount;
+	enum encodingFormat format;
+	File out;
+	char *bytes;
+	size_t size;
+};
+
+// a single entry of a decode table.
+// an entry either emits one or more whole characters, or links to
+// a subtable for codes that are longer than the table's index width.
+struct decodeEntry {
+	uint8_t bits;  // number of bits consumed by this entry
+	uint8_t len;   // number of bytes emitted, 0 if this is a link
+	uint8_t width; // index width of the linked subtable
+	char out[DECODE_OUT_LEN];
+	uint32_t next; // offset of the linked subtable
+};
+
+// lookup tables compiled from a huffman tree.
+// all tables live in entries, with the root table first.
+// single is a copy of the root table holding one character per entry,
+// which is used near the end of the encoding.
+struct decoder {
+	struct decodeEntry *entries;
+	struct decodeEntry *single;
+	int rootBits;
+	uint32_t size;
+	uint32_t capacity;
+};
+
+// the code table and decode tables of a model.
+// a model loaded from a file keeps it open in file, and its tables
+// point into the file's bytes rather than being allocated.
+// a model of a tree keeps it flattened in flat, and only builds its
+// code table once it is first used to encode.
+struct huffmanModel {
+	struct codeTable *table;
+	struct decoder *dec; // NULL if there is only one character
+	struct flatTree *flat;
+	File file;
+};
+
+// the header of a model file. the code table's encoders (its direct
+// entries and slots), its chunks and the decode tables follow at the
+// given offsets, laid out exactly as they are in memory, so they are
+// used where they lie rather than read in. lengths let other machines
+// reject the file.
+struct modelHeader {
+	char magic[MODEL_MAGIC_LEN];
+	uint32_t byteOrder;
+	uint32_t encoderLen;
+	uint32_t entryLen;
+	uint32_t count;
+	uint32_t hashBits;
+	uint32_t rootBits;
+	uint32_t decodeSize; // number of decode entries, 0 if there are none
+	uint32_t bytes;      // whether the model is of a byte code
+	uint32_t chunkCount;
+	uint64_t encodersOffset;
+	uint64_t chunksOffset;
+	uint64_t entriesOffset;
+	uint64_t singleOffset;
+};
+
+// where decoded text goes: written to file, or copied into the len
+// bytes at dest when file is NULL. size counts the bytes so far.
+struct decodeOutput {
+	File file;
+	char *dest;
+	size_t len;
+	size_t size;
+};
+
+// a batch list being read. filenames handed out point into line,
+// the last line read.
+struct batchList {
+	FILE *fp;
+	char *line;
+	size_t size;
 };
 
+// number of threads to use, or 0 for one per online processor
+static int huffmanThreads = 0;
+
+// the text encoding of every byte, most significant bit first,
+// filled in once by bitTextInit
+static char bitText[256][8];
+static pthread_once_t bitTextOnce = PTHREAD_ONCE_INIT;
+
 // INTERNAL FUNCTIONS
 // note that only internal functions (marked with static)
 // are declared here, for the main one see huffman.h
 
+// arena functions
+static struct arena *arenaNew(void);
+static void *arenaAlloc(struct arena *, size_t size);
+static void arenaFree(struct arena *);
+
 // misc functions.
 static bool isLeaf(struct huffmanTree *);
 static int leafCount(struct huffmanTree *);
-static int characterSum(char *);
+static uint32_t characterKey(char *, int len);
 static int treeHeight(struct huffmanTree *);
-
-// HuffmanTreeArena functions
+static void putUint64(char *bytes, uint64_t value);
+static uint64_t getUint64(char *bytes);
+
+// bitReader functions
+static void bitReaderInit(struct bitReader *, File in, char *bytes,
+                          size_t len);
+static void bitReaderSeek(struct bitReader *, uint64_t start, uint64_t end);
+static uint64_t packedBitCount(char *rest, size_t len);
+static bool bitReaderRefill(struct bitReader *);
+static int bitReaderFill(struct bitReader *);
+static uint32_t bitReaderPeek(struct bitReader *, int n);
+static void bitReaderSkip(struct bitReader *, int n);
+
+// bitWriter functions
+static struct bitWriter *bitWriterNew(File out, enum encodingFormat format);
+static void bitWriterPut(struct bitWriter *, uint64_t bits, int len);
+static void bitWriterPutCode(struct bitWriter *, struct codeTable *,
+                             struct encoder *);
+static void bitWriterEmit(struct bitWriter *, int nbytes);
+static void bitWriterFlush(struct bitWriter *);
+static void bitWriterFinish(struct bitWriter *);
+static void bitWriterFree(struct bitWriter *);
+static void bitTextInit(void);
+static void bitsToText(char *dest, uint64_t bits, int len);
+
+// decoder functions
+static struct decoder *decoderNew(struct flatTree *);
+static uint32_t decoderAlloc(struct decoder *, int width);
+static void decoderFill(struct decoder *, struct flatTree *);
+static void decoderPack(struct decoder *);
+static struct decoder *decoderNewCanonical(CanonicalCode);
+static struct decoder *decoderEmpty(int maxLength);
+static void decoderFinish(struct decoder *);
+static void decoderFillCanonical(struct decoder *, uint32_t base, int width,
+                                 struct canonicalSymbol *symbols, int count,
+                                 int depth);
+static void decoderRun(struct decoder *, struct bitReader *,
+                       struct decodeOutput *);
+static void decodeOutputWrite(struct decodeOutput *, char *bytes,
+                              size_t len);
+static void decoderFree(struct decoder *);
+
+// stream functions
+static void encodeWith(struct codeTable *, File in, File out,
+                       enum encodingFormat format, File indexFile,
+                       int blockLen);
+static void decodeWith(struct decoder *, File in, File out);
+static void decodeIndexedWith(struct decoder *, File in, File index,
+                              File out, size_t from, size_t to);
+
+// parallel decoding functions
+static void *decodeJobRun(void *job);
+
+// blockIndex functions
+static struct blockIndex *blockIndexNew(uint64_t blockLen);
+static void blockIndexSeek(struct blockIndex *, uint64_t symbols,
+                           uint64_t bytes);
+static void blockIndexStep(struct blockIndex *, uint64_t bit, int charLen);
+static void blockIndexAdd(struct blockIndex *, uint64_t bit, uint64_t symbol,
+                          uint64_t byte);
+static void blockIndexAppend(struct blockIndex *, struct blockIndex *other,
+                             uint64_t bitBase);
+static size_t blockIndexFind(struct blockIndex *, uint64_t byte);
+static void blockIndexWrite(struct blockIndex *, File out);
+static struct blockIndex *blockIndexRead(File in);
+static void blockIndexFree(struct blockIndex *);
+
+// tree file functions
+static char *treeFileBytes(File in, size_t *len, bool *copied);
+static void treeFileError(void);
+
+// canonicalCode functions
+static void canonicalCollect(struct canonicalCode *, struct huffmanTree *,
+                             int depth);
+static void canonicalAssign(struct canonicalCode *);
+static int canonicalCompare(const void *, const void *);
+static int characterCompare(const void *, const void *);
+static void byteCount(File, uint64_t counts[BYTE_SYMBOLS]);
+static CanonicalCode byteCodeRead(File);
+static uint64_t canonicalBits(struct canonicalSymbol *, int from, int n);
+
+// threading functions
+static int threadCount(size_t len);
+static void runJobs(void *(*run)(void *), void *jobs, size_t jobSize,
+                    int count);
+static size_t splitText(char *text, size_t len, int piece, int pieces);
+
+// counting functions
+static Counter countStream(File);
+static void *countJobRun(void *job);
+static bool countCharacters(Counter, char *text, size_t len);
+static int symbolLength(struct codeTable *, unsigned char byte1);
+
+// flatTree functions
+static struct flatTree *flatTreeNew(struct huffmanTree *tree);
+static void flatTreeFree(struct flatTree *);
+
+// tree building functions
+static struct huffmanTree *huffmanTreeFromItems(struct item *, int count);
+static int *packageMerge(uint64_t *weights, int count, int maxLength);
+static int mergeItemCompare(const void *, const void *);
+static struct huffmanTree *canonicalTree(struct canonicalCode *);
+static struct huffmanTree *huffmanTreeNode(void);
+static int treeSetFreq(struct huffmanTree *, Counter);
+static uint64_t treeCost(struct huffmanTree *, int depth);
+static void freeTree(struct huffmanTree *);
+
+// huffmanHeap functions
 static struct huffmanTree *huffmanTreeFromItem(struct item);
-static struct huffmanTreeArena *huffmanTreeArenaNew(void);
-static struct huffmanTreeArenaNode *
-huffmanTreeArenaPop(struct huffmanTreeArena *);
-static void huffmanTreeArenaFree(struct huffmanTreeArena *);
-static bool huffmanTreeArenaAdd(struct huffmanTreeArena *,
-                                struct huffmanTree *);
-
-// prefix path functions
-static struct prefixPath *prefixPathNew(void);
-static struct prefixPath *prefixPathCopy(struct prefixPath *orig);
-static struct encoder *prefixPathEncoding(struct prefixPath *);
-static void prefixPathFree(struct prefixPath *);
-static void prefixPathRecord(struct prefixPath *, char, char *);
-
-// huffmanCrawler functions
-static struct huffmanCrawler *crawlerCopy(struct huffmanCrawler *crawler);
-static struct huffmanCrawler *crawlLeft(struct huffmanCrawler *crawler);
-static struct huffmanCrawler *crawlRight(struct huffmanCrawler *crawler);
-
-// huffmanTraverser functions
-static struct huffmanTraverser *huffmanTraverserInit(struct huffmanTree *tree);
-static struct encoder *huffmanTraverserPerform(struct huffmanTraverser *trav);
-static struct huffmanCrawler *
-huffmanTraverserPop(struct huffmanTraverser *trav);
-static void huffmanTraverserAdd(struct huffmanTraverser *trav,
-                                struct huffmanCrawler *crawler);
-static void huffmanTraverserDeinit(struct huffmanTraverser *);
+static struct huffmanHeap *huffmanHeapNew(int capacity);
+static void huffmanHeapAdd(struct huffmanHeap *, struct huffmanTree *);
+static struct huffmanTree *huffmanHeapPop(struct huffmanHeap *);
+static bool huffmanHeapLess(struct huffmanHeapEntry *,
+                            struct huffmanHeapEntry *);
+static void huffmanHeapFree(struct huffmanHeap *);
+
+// parallel encoding functions
+static void encodeText(struct codeTable *, struct bitWriter *,
+                       struct blockIndex *, char *text, size_t len);
+static bool encodeSymbols(struct codeTable *, struct bitWriter *,
+                          struct blockIndex *, char *text, size_t len);
+static bool encodeWindow(struct codeTable *, struct bitWriter *,
+                         struct blockIndex *, struct encodeJob *jobs,
+                         int threads, char *text, size_t len);
+static void *encodeJobMeasure(void *job);
+static void *encodeJobWrite(void *job);
+static void encodeJobPut(struct encodeJob *, uint64_t *acc, int *count,
+                         uint64_t *byteIndex, uint64_t bits, int len);
+static void encodeJobStore(struct encodeJob *, uint64_t byteIndex,
+                           unsigned char byte);
+
+// codeTable functions
+static struct codeTable *codeTableNew(struct flatTree *);
+static struct codeTable *codeTableNewCanonical(CanonicalCode);
+static struct codeTable *codeTableIndex(struct encoder *encoders, int count);
+static uint32_t codeChunkAdd(struct codeChunk **chunks, uint32_t *count,
+                             uint32_t *capacity, struct codeChunk chunk);
+static struct encoder *codeTableFind(struct codeTable *, uint32_t key);
+static struct codeChunk **codeTableChunks(struct codeTable *,
+                                          struct encoder *,
+                                          struct codeChunk **local);
+static uint64_t codeTableCost(struct codeTable *, Counter);
+
+// model file functions
+static struct codeTable *modelTable(HuffmanModel);
+static bool modelHeaderValid(struct modelHeader *, size_t len);
+static bool modelRegionValid(uint64_t offset, uint64_t regionLen,
+                             size_t len);
+static bool modelTablesValid(struct codeTable *, struct decoder *);
+static void codeTableFree(struct codeTable *);
 
 // buffer function
 static struct buffer *bufferInit(size_t size);
 static char *bufferGetStr(struct buffer *);
-static void bufferInsert(struct buffer *, char *chars, unsigned int len);
+static void bufferInsert(struct buffer *, uint64_t bits, int len);
+static void bufferInsertCode(struct buffer *, struct codeTable *,
+                             struct encoder *);
 static void bufferFree(struct buffer *);
 
 // Task 1
 // decode huffman data given tree and encoding
+// the tree is compiled into lookup tables first, so that each step
+// looks at the next few bits at once rather than walking the tree.
 void decode(struct huffmanTree *tree, char *encoding, char *outputFilename) {
 	File file = FileOpenToWrite(outputFilename);
-	size_t encodingPtr = 0;
-	struct huffmanTree *root = tree;
-	struct huffmanTree *treePtr = tree;
-	while (true) {
-		if (isLeaf(treePtr)) {
-			FileWrite(file, treePtr->character);
-			treePtr = root;
-			continue;
-		}
+	struct flatTree *flat = flatTreeNew(tree);
+	struct decoder *dec = decoderNew(flat);
+	flatTreeFree(flat);
+	// a lone leaf has an empty code, so there is nothing to decode.
+	if (dec != NULL) {
+		struct bitReader reader;
+		bitReaderInit(&reader, NULL, encoding, strlen(encoding));
+		struct decodeOutput output = {file, NULL, 0, 0};
+		decoderRun(dec, &reader, &output);
+		decoderFree(dec);
+	}
+	FileClose(file);
+}
 
-		if (encoding[encodingPtr] == '0') {
-			treePtr = treePtr->left;
-		} else if (encoding[encodingPtr] == '1') {
-			treePtr = treePtr->right;
-		} else {
-			break;
+// decode the encoding in in using dec, or nothing if dec is NULL.
+// the encoding is read a chunk at a time as decoding goes.
+static void decodeWith(struct decoder *dec, File in, File out) {
+	if (dec == NULL) {
+		return;
+	}
+	char *chunk = malloc(READ_CHUNK_LEN);
+	struct bitReader reader;
+	bitReaderInit(&reader, in, chunk,
+	              FileReadBytes(in, chunk, READ_CHUNK_LEN));
+	struct decodeOutput output = {out, NULL, 0, 0};
+	decoderRun(dec, &reader, &output);
+	free(chunk);
+}
+
+// decode bytes from up to to of the text encoded in in using dec,
+// or nothing if dec is NULL. only the blocks holding those bytes are
+// decoded. they are handed out to threads a window at a time, each
+// thread decoding a run of blocks into memory, and the runs are written
+// out in order.
+static void decodeIndexedWith(struct decoder *dec, File in, File index,
+                              File out, size_t from, size_t to) {
+	size_t len;
+	char *encoding = FileReadRest(in, &len);
+	if (encoding == NULL) {
+		fprintf(stderr, "error: the encoding must be held in memory to be "
+		                "decoded with a block index\n");
+		exit(EXIT_FAILURE);
+	}
+	struct blockIndex *idx = blockIndexRead(index);
+	struct blockEntry *entries = idx->entries;
+	if (to > entries[idx->count - 1].byte) {
+		to = entries[idx->count - 1].byte;
+	}
+	if (dec == NULL || from >= to) {
+		blockIndexFree(idx);
+		return;
+	}
+
+	size_t block = blockIndexFind(idx, from);
+	size_t last = blockIndexFind(idx, to - 1) + 1;
+	int threads = threadCount(entries[last].byte - entries[block].byte);
+	struct decodeJob *jobs = malloc(sizeof(struct decodeJob) * threads);
+	while (block < last) {
+		int count = 0;
+		for (; count < threads && block < last; count++) {
+			size_t stop = block + 1;
+			while (stop < last && entries[stop].byte - entries[block].byte <
+			                          DECODE_THREAD_CHUNK_LEN) {
+				stop++;
+			}
+			jobs[count].dec = dec;
+			jobs[count].encoding = encoding;
+			jobs[count].len = len;
+			jobs[count].start = &entries[block];
+			jobs[count].end = &entries[stop];
+			jobs[count].out = malloc(entries[stop].byte - entries[block].byte);
+			block = stop;
+		}
+		runJobs(decodeJobRun, jobs, sizeof(struct decodeJob), count);
+
+		// the first and last runs may hold text outside the range
+		for (int ix = 0; ix < count; ix++) {
+			uint64_t start = jobs[ix].start->byte;
+			uint64_t end = jobs[ix].end->byte;
+			uint64_t skip = from > start ? from - start : 0;
+			uint64_t keep = (to < end ? to : end) - start - skip;
+			FileWriteBytes(out, jobs[ix].out + skip, keep);
+			free(jobs[ix].out);
 		}
-		encoding++;
 	}
-	FileClose(file);
+	free(jobs);
+	blockIndexFree(idx);
+}
+
+// thread entry point for decoding a run of blocks
+static void *decodeJobRun(void *arg) {
+	struct decodeJob *job = arg;
+	struct bitReader reader;
+	bitReaderInit(&reader, NULL, job->encoding, job->len);
+	bitReaderSeek(&reader, job->start->bit, job->end->bit);
+	size_t len = job->end->byte - job->start->byte;
+	struct decodeOutput output = {NULL, job->out, len, 0};
+	decoderRun(job->dec, &reader, &output);
+	if (output.size != len) {
+		fprintf(stderr, "error: block index does not match the encoding\n");
+		exit(EXIT_FAILURE);
+	}
+	return NULL;
 }
 
 // check if current tree node is a leaf
@@ -164,448 +702,2664 @@ static bool isLeaf(struct huffmanTree *tree) {
 	return tree->left == NULL && tree->right == NULL;
 }
 
-// Task 3
-struct huffmanTree *createHuffmanTree(char *inputFilename) {
-	Counter charCount = CounterNew();
-	File fstream = FileOpenToRead(inputFilename);
-	int distinctCharCount = 0;
-
-	// generate count tree.
-	char charUtf8[MAX_CHARACTER_LEN + 1];
-	while (FileReadCharacter(fstream, charUtf8)) {
-		CounterAdd(charCount, charUtf8);
+// implementation of bitReader functions
+
+// read bits starting from the len bytes at bytes, followed by the
+// rest of in if it is not NULL. the format is worked out from the magic.
+// text encodings end at the first character that is not '0' or '1'.
+static void bitReaderInit(struct bitReader *r, File in, char *bytes,
+                          size_t len) {
+	r->acc = 0;
+	r->count = 0;
+	r->in = in;
+	r->bytes = bytes;
+	r->pos = 0;
+	r->len = len;
+	r->sized = false;
+	r->bitsLeft = 0;
+	r->packed = len >= PACKED_MAGIC_LEN &&
+	            memcmp(bytes, PACKED_MAGIC, PACKED_MAGIC_LEN) == 0;
+	if (r->packed) {
+		r->pos = PACKED_MAGIC_LEN;
+		if (in == NULL) {
+			r->sized = true;
+			r->bitsLeft = packedBitCount(bytes + r->pos, len - r->pos);
+		}
 	}
+}
 
-	// create an array of huffman trees, each containing one character and a
-	// frequncy.
-	struct item *fileCharData = CounterItems(charCount, &distinctCharCount);
-	struct huffmanTreeArena *treeArena = huffmanTreeArenaNew();
-	for (int index = 0; index < distinctCharCount; index++) {
-		struct huffmanTree *tree = huffmanTreeFromItem(fileCharData[index]);
-		huffmanTreeArenaAdd(treeArena, tree);
+// move a reader over an encoding held in memory to bit start, so that
+// it stops at bit end. exits if the encoding has fewer than end bits.
+static void bitReaderSeek(struct bitReader *r, uint64_t start, uint64_t end) {
+	r->acc = 0;
+	r->count = 0;
+	uint64_t bitCount =
+	    r->packed ? packedBitCount(r->bytes + PACKED_MAGIC_LEN,
+	                               r->len - PACKED_MAGIC_LEN)
+	              : r->len;
+	if (start > end || end > bitCount) {
+		fprintf(stderr, "error: block index does not match the encoding\n");
+		exit(EXIT_FAILURE);
+	}
+	if (r->packed) {
+		// start from the byte holding bit start, then skip up to it
+		r->pos = PACKED_MAGIC_LEN + start / 8;
+		r->bitsLeft = end - start + start % 8;
+		bitReaderFill(r);
+		bitReaderSkip(r, start % 8);
+	} else {
+		r->pos = start;
+		r->len = end;
 	}
+}
 
-	while (treeArena->size != 1) {
-		struct huffmanTree *newBiggerTree = malloc(sizeof(struct huffmanTree));
-		struct huffmanTreeArenaNode *arenaNode1 =
-		    huffmanTreeArenaPop(treeArena);
-		struct huffmanTreeArenaNode *arenaNode2 =
-		    huffmanTreeArenaPop(treeArena);
-		struct huffmanTree *lowestFirst = arenaNode1->tree;
-		struct huffmanTree *lowestSecond = arenaNode2->tree;
+// the number of bits in the last len bytes of a packed encoding, which
+// end with the count of the bits used in the byte before it.
+// exits if the count does not fit.
+static uint64_t packedBitCount(char *rest, size_t len) {
+	unsigned char last = len == 0 ? 0xFF : rest[len - 1];
+	if (len == 1 && last == 0) {
+		return 0;
+	} else if (len < 2 || last < 1 || last > 8) {
+		fprintf(stderr, "error: packed encoding is truncated or corrupt\n");
+		exit(EXIT_FAILURE);
+	}
+	return (uint64_t)(len - 2) * 8 + last;
+}
 
-		newBiggerTree->character = NULL;
-		newBiggerTree->freq = lowestFirst->freq + lowestSecond->freq;
-		newBiggerTree->left = lowestFirst;
-		newBiggerTree->right = lowestSecond;
+// read the next chunk of the encoding, keeping any bytes of the current
+// one that are not used up yet. returns false at the end of the file.
+static bool bitReaderRefill(struct bitReader *r) {
+	if (r->in == NULL) {
+		return false;
+	}
+	size_t kept = r->len - r->pos;
+	memmove(r->bytes, r->bytes + r->pos, kept);
+	r->len = kept + FileReadBytes(r->in, r->bytes + kept,
+	                              READ_CHUNK_LEN - kept);
+	r->pos = 0;
+	return r->len > kept;
+}
 
-		huffmanTreeArenaAdd(treeArena, newBiggerTree);
-		free(arenaNode1);
-		free(arenaNode2);
+// top up the bit buffer, returning the number of bits buffered.
+// at least 57 bits are buffered unless the end of the encoding is near.
+static int bitReaderFill(struct bitReader *r) {
+	if (r->packed) {
+		while (r->count <= 56) {
+			// the last two bytes may be the last byte of bits and the count
+			// of its bits, so they are only taken once more bytes follow
+			if (!r->sized && r->len - r->pos <= 2 && !bitReaderRefill(r)) {
+				r->sized = true;
+				r->bitsLeft =
+				    packedBitCount(r->bytes + r->pos, r->len - r->pos);
+			}
+			int n = 8;
+			if (r->sized) {
+				if (r->bitsLeft == 0) {
+					break;
+				}
+				n = r->bitsLeft < 8 ? r->bitsLeft : 8;
+				r->bitsLeft -= n;
+			}
+			uint64_t byte = (unsigned char)r->bytes[r->pos++];
+			// clear any padding after the last bit
+			byte &= 0xFF00 >> n;
+			r->acc |= byte << (56 - r->count);
+			r->count += n;
+		}
+		return r->count;
 	}
-	struct huffmanTreeArenaNode *lastNode = huffmanTreeArenaPop(treeArena);
-	struct huffmanTree *finalTree = lastNode->tree;
 
-	free(lastNode);
-	huffmanTreeArenaFree(treeArena);
-	free(fileCharData);
-	FileClose(fstream);
-	CounterFree(charCount);
-	return finalTree;
-}
+	while (r->count <= 56) {
+		if (r->len - r->pos >= 8) {
+			uint64_t word = 0;
+			for (int ix = 0; ix < 8; ix++) {
+				word |= (uint64_t)(unsigned char)r->bytes[r->pos + ix]
+				        << (8 * ix);
+			}
+			// both '0' and '1' are 0x30 once their low bit is cleared
+			if ((word & 0xFEFEFEFEFEFEFEFE) == 0x3030303030303030) {
+				// gather the low bit of the 8 characters, the first
+				// character landing in the most significant bit.
+				word &= 0x0101010101010101;
+				uint64_t byte = (word * 0x8040201008040201) >> 56;
+				r->acc |= byte << (56 - r->count);
+				r->count += 8;
+				r->pos += 8;
+				continue;
+			}
+		}
 
-// helper functions
+		if (r->pos == r->len && !bitReaderRefill(r)) {
+			break;
+		}
+		char c = r->bytes[r->pos];
+		if (c != ENCODING_0 && c != ENCODING_1) {
+			// end of the encoding, so stop reading
+			r->in = NULL;
+			r->len = r->pos;
+			break;
+		}
+		uint64_t bit = c - ENCODING_0;
+		r->acc |= bit << (63 - r->count);
+		r->count++;
+		r->pos++;
+	}
+	return r->count;
+}
 
-// create a leaf huffmanTree from item struct
-static struct huffmanTree *huffmanTreeFromItem(struct item item) {
-	struct huffmanTree *newTree = malloc(sizeof(struct huffmanTree));
-	newTree->character = malloc(sizeof(char) * (MAX_CHARACTER_LEN + 1));
-	strncpy(newTree->character, item.character, MAX_CHARACTER_LEN + 1);
-	newTree->freq = item.freq;
-	newTree->left = NULL;
-	newTree->right = NULL;
-	return newTree;
+// look at the next n bits without consuming them.
+// bits past the end of the encoding read as 0.
+static uint32_t bitReaderPeek(struct bitReader *r, int n) {
+	return r->acc >> (64 - n);
 }
 
-// initialise a huffmanTreeArena
-static struct huffmanTreeArena *huffmanTreeArenaNew() {
-	struct huffmanTreeArena *arena = malloc(sizeof(struct huffmanTreeArena));
-	arena->head = NULL;
-	arena->size = 0;
-	return arena;
+// consume n bits, which must already be buffered.
+static void bitReaderSkip(struct bitReader *r, int n) {
+	r->acc <<= n;
+	r->count -= n;
 }
 
-// free arena
-// this must be done once the full tree is completed
-// asserts that there are no nodes inside.
-static void huffmanTreeArenaFree(struct huffmanTreeArena *arena) {
-	assert(arena->size == 0);
-	free(arena->head);
-	free(arena);
+// implementation of bitWriter functions
+
+// create a bitWriter writing to out.
+// packed encodings start with their magic.
+static struct bitWriter *bitWriterNew(File out, enum encodingFormat format) {
+	struct bitWriter *w = malloc(sizeof(struct bitWriter));
+	w->acc = 0;
+	w->count = 0;
+	w->bitCount = 0;
+	w->format = format;
+	w->out = out;
+	w->bytes = malloc(WRITE_CHUNK_LEN);
+	w->size = 0;
+	if (format == ENCODING_PACKED) {
+		memcpy(w->bytes, PACKED_MAGIC, PACKED_MAGIC_LEN);
+		w->size = PACKED_MAGIC_LEN;
+	}
+	return w;
 }
 
-// add to huffman tree arena
-// tree must be inserted in ascending order
-// and should always return true.
-static bool huffmanTreeArenaAdd(struct huffmanTreeArena *arena,
-                                struct huffmanTree *tree) {
-	// memory initialisation
-	struct huffmanTreeArenaNode *newNode =
-	    malloc(sizeof(struct huffmanTreeArenaNode));
-
-	// assign objects in memory
-	newNode->tree = tree;
-	newNode->next = NULL;
-
-	// base case: arena has no nodes.
-	if (arena->size == 0) {
-		arena->head = newNode;
-		arena->size++;
-		return true;
-	}
-
-	// case: letter frequency is smallest.
-	if (newNode->tree->freq < arena->head->tree->freq) {
-		newNode->next = arena->head;
-		arena->head = newNode;
-		arena->size++;
-		return true;
-	}
-
-	// case: letter frequency is a middle value.
-	struct huffmanTreeArenaNode *arenaNode = arena->head;
-	while (arenaNode->next != NULL) {
-		if (newNode->tree->freq < arenaNode->next->tree->freq) {
-			newNode->next = arenaNode->next;
-			arenaNode->next = newNode;
-			arena->size++;
-			return true;
+// append the low len bits of bits, most significant first.
+// len is at most 64, and any higher bits must be 0.
+static void bitWriterPut(struct bitWriter *w, uint64_t bits, int len) {
+	if (len == 0) {
+		return;
+	}
+	w->bitCount += len;
+	if (w->format == ENCODING_TEXT) {
+		if (w->size + len > WRITE_CHUNK_LEN) {
+			bitWriterFlush(w);
 		}
-		arenaNode = arenaNode->next;
+		bitsToText(&w->bytes[w->size], bits, len);
+		w->size += len;
+		return;
 	}
 
-	// case: letter frequency is largest.
-	arenaNode->next = newNode;
-	arena->size++;
-	return true;
-}
+	int space = 64 - w->count;
+	if (len < space) {
+		w->acc |= bits << (space - len);
+		w->count += len;
+		return;
+	}
 
-// remove and return the first node in the arena
-// popped nodes must be freed individually.
-static struct huffmanTreeArenaNode *
-huffmanTreeArenaPop(struct huffmanTreeArena *arena) {
-	struct huffmanTreeArenaNode *popped = arena->head;
-	arena->head = arena->head->next;
-	arena->size--;
-	return popped;
+	// fill up the word, move it out and keep what is left over
+	int rest = len - space;
+	w->acc |= bits >> rest;
+	w->count = 64;
+	bitWriterEmit(w, 8);
+	w->acc = rest == 0 ? 0 : bits << (64 - rest);
+	w->count = rest;
 }
 
-// Task 4
-char *encode(struct huffmanTree *tree, char *inputFilename) {
-	// TODO: fix this somehow
-	// initial data
-	File fstream = FileOpenToRead(inputFilename);
-	char charBuf[MAX_CHARACTER_LEN + 1];
-	int symCount = leafCount(tree);
-	int maxEncLen = treeHeight(tree) + 1;
-	struct buffer *buf =
-	    bufferInit(symCount * symCount * maxEncLen * maxEncLen);
-	struct huffmanTraverser *trav = huffmanTraverserInit(tree);
-	struct encoder *encoders = malloc(sizeof(struct encoder) * symCount);
-
-	// generate encoding tree from huffman tree
-	for (int ix = 0; ix < symCount; ix++) {
-		struct encoder *enc = huffmanTraverserPerform(trav);
-		encoders[ix].charSum = enc->charSum;
-		encoders[ix].encodingLength = enc->encodingLength;
-		encoders[ix].encoding = malloc(encoders[ix].encodingLength);
-		strncpy(encoders[ix].encoding, enc->encoding, enc->encodingLength);
-		free(enc->encoding);
-		free(enc);
-	}
-
-	// somehow encode the entire text in file onto one massive string.
-	while (FileReadCharacter(fstream, charBuf)) {
-		int charKey = characterSum(charBuf);
-		int ix = 0;
-		while (encoders[ix].charSum != charKey) {
-			ix++;
-		}
-		bufferInsert(buf, encoders[ix].encoding,
-		             encoders[ix].encodingLength - 1);
+// append the code of enc, a chunk at a time if it is longer than 64 bits
+static void bitWriterPutCode(struct bitWriter *w, struct codeTable *table,
+                             struct encoder *enc) {
+	if (enc->length <= 64) {
+		bitWriterPut(w, enc->bits, enc->length);
+		return;
 	}
-
-	char *result = bufferGetStr(buf);
-
-	// cleanup :)
-	for (int ix = 0; ix < symCount; ix++) {
-		free(encoders[ix].encoding);
+	struct codeChunk *local[LOCAL_CHUNKS];
+	struct codeChunk **chunks = codeTableChunks(table, enc, local);
+	for (int ix = 0; ix < (enc->length + 63) / 64; ix++) {
+		bitWriterPut(w, chunks[ix]->bits, chunks[ix]->length - 64 * ix);
+	}
+	if (chunks != local) {
+		free(chunks);
 	}
-	free(encoders);
-	huffmanTraverserDeinit(trav);
-	bufferFree(buf);
-	FileClose(fstream);
-	return result;
 }
 
-// get the number of leaves in the tree
-static int leafCount(struct huffmanTree *tree) {
-	if (tree == NULL) {
-		return 0;
+// move the top nbytes bytes of the accumulator into the chunk
+static void bitWriterEmit(struct bitWriter *w, int nbytes) {
+	if (w->size + nbytes > WRITE_CHUNK_LEN) {
+		bitWriterFlush(w);
 	}
-	int countedLeaves = leafCount(tree->left) + leafCount(tree->right);
-	if (countedLeaves == 0) {
-		return countedLeaves + 1;
+	for (int ix = 0; ix < nbytes; ix++) {
+		w->bytes[w->size++] = w->acc >> (56 - 8 * ix);
 	}
-	return countedLeaves;
 }
 
-// get tree height
-static int treeHeight(struct huffmanTree *tree) {
-	if (tree == NULL) {
-		return 0;
-	} else {
-		int heightLeft = treeHeight(tree->left);
-		int heightRight = treeHeight(tree->right);
-		int max;
-		if (heightLeft > heightRight) {
-			max = heightLeft;
-		} else {
-			max = heightRight;
-		}
-		return max + 1;
-	}
+// write out the chunk
+static void bitWriterFlush(struct bitWriter *w) {
+	FileWriteBytes(w->out, w->bytes, w->size);
+	w->size = 0;
 }
 
-// a hashing function for getting a unique number
-// of a character.
-// initial iteration simply added the numerical value
-// of each character into the integer, which failed
-// for some of the bigger file encodings
-// current iteration improves on this a lot, but it's still
-// not perfect: prone to collisions and fails to
-// properly encode wonderland
-static int characterSum(char *str) {
-	unsigned int ix = 0;
-	int sum = 0;
-	while (str[ix] != '\0') {
-		sum += str[ix] * str[ix];
-		ix++;
+// write out any remaining bits, padding the last byte with 0s.
+// packed encodings end with the number of bits used in that byte.
+static void bitWriterFinish(struct bitWriter *w) {
+	if (w->format == ENCODING_PACKED) {
+		bitWriterEmit(w, (w->count + 7) / 8);
+		w->acc = w->bitCount == 0 ? 0 : (w->bitCount - 1) % 8 + 1;
+		w->acc <<= 56;
+		bitWriterEmit(w, 1);
+		w->acc = 0;
+		w->count = 0;
 	}
-	return sum;
+	bitWriterFlush(w);
 }
 
-// implementation of huffmanTraverser functions
-
-// initialises a traverser for a specified tree
-static struct huffmanTraverser *huffmanTraverserInit(struct huffmanTree *tree) {
-	struct huffmanTraverser *trav = malloc(sizeof(struct huffmanTraverser));
-	struct huffmanCrawler *initCrawler = malloc(sizeof(struct huffmanCrawler));
-	initCrawler->address = prefixPathNew();
-	initCrawler->tree = tree;
-	initCrawler->next = NULL;
-	trav->head = initCrawler;
-	trav->tail = initCrawler;
-	return trav;
+// free bitWriter, which must be finished first
+static void bitWriterFree(struct bitWriter *w) {
+	free(w->bytes);
+	free(w);
 }
 
-// traverse the tree via traverser until we find a leaf node,
-// then return the character and it's encoding via a struct.
-static struct encoder *huffmanTraverserPerform(struct huffmanTraverser *trav) {
-	while (true) {
-		struct huffmanCrawler *poppedCrawler = huffmanTraverserPop(trav);
-		if (poppedCrawler->tree->character != NULL) {
-			prefixPathRecord(poppedCrawler->address, ENCODING_END,
-			                 poppedCrawler->tree->character);
-			struct encoder *charEnc =
-			    prefixPathEncoding(poppedCrawler->address);
-			prefixPathFree(poppedCrawler->address);
-			free(poppedCrawler);
-			return charEnc;
-		} else {
-			if (poppedCrawler->tree->left != NULL) {
-				struct huffmanCrawler *left = crawlLeft(poppedCrawler);
-				huffmanTraverserAdd(trav, left);
-			}
-			if (poppedCrawler->tree->right != NULL) {
-				struct huffmanCrawler *right = crawlRight(poppedCrawler);
-				huffmanTraverserAdd(trav, right);
-			}
-			prefixPathFree(poppedCrawler->address);
-			free(poppedCrawler);
+// fill in the text encoding of every byte
+static void bitTextInit(void) {
+	for (int byte = 0; byte < 256; byte++) {
+		for (int bit = 0; bit < 8; bit++) {
+			bitText[byte][bit] =
+			    (byte >> (7 - bit)) & 1 ? ENCODING_1 : ENCODING_0;
 		}
 	}
 }
 
-// remove first element within the traverser
-static struct huffmanCrawler *
-huffmanTraverserPop(struct huffmanTraverser *trav) {
-	struct huffmanCrawler *pop = trav->head;
-	trav->head = trav->head->next;
-	return pop;
+// write the low len bits of bits to dest as text, most significant
+// first. whole bytes of the code are copied from bitText 8 at a time.
+static void bitsToText(char *dest, uint64_t bits, int len) {
+	pthread_once(&bitTextOnce, bitTextInit);
+	int lead = len % 8;
+	for (int ix = 0; ix < lead; ix++) {
+		dest[ix] = (bits >> (len - 1 - ix)) & 1 ? ENCODING_1 : ENCODING_0;
+	}
+	for (int shift = len - lead - 8; shift >= 0; shift -= 8) {
+		memcpy(&dest[len - shift - 8], bitText[(bits >> shift) & 0xff], 8);
+	}
 }
 
-// append an element to the huffman traverser
-static void huffmanTraverserAdd(struct huffmanTraverser *trav,
-                                struct huffmanCrawler *crawl) {
-	if (trav->head == NULL) {
-		trav->head = crawl;
-		trav->tail = crawl;
-	} else {
-		trav->tail->next = crawl;
-		trav->tail = trav->tail->next;
+// implementation of decoder functions
+
+// compile a flattened huffman tree into decode tables.
+// returns NULL if the tree is a lone leaf, which has an empty code,
+// so there is nothing to decode.
+static struct decoder *decoderNew(struct flatTree *flat) {
+	if (flat->nodes[0].left == 0) {
+		return NULL;
 	}
+	struct decoder *dec = decoderEmpty(flat->nodes[0].height);
+	decoderFill(dec, flat);
+	decoderFinish(dec);
+	return dec;
 }
 
-// free huffman traverser
-// asserts there are no more crawlers tracked
-static void huffmanTraverserDeinit(struct huffmanTraverser *trav) {
-	assert(trav->head == NULL);
-	free(trav);
+// compile a canonical code into decode tables, without building a tree.
+// returns NULL if the code is a lone character with an empty code.
+static struct decoder *decoderNewCanonical(CanonicalCode code) {
+	if (code->symbols[code->count - 1].length == 0) {
+		return NULL;
+	}
+	int maxLength = code->symbols[code->count - 1].length;
+	struct decoder *dec = decoderEmpty(maxLength);
+	decoderFillCanonical(dec, 0, dec->rootBits, code->symbols, code->count,
+	                     0);
+	if (code->count == 1) {
+		// a lone byte is encoded as 0s, but 1s decode to it as well,
+		// so that no entry is left empty
+		dec->entries[1] = dec->entries[0];
+	}
+	decoderFinish(dec);
+	return dec;
 }
 
-// implementation of huffmanCrawler functions
+// create decode tables with an empty root table, wide enough for codes
+// of maxLength bits up to DECODE_BITS
+static struct decoder *decoderEmpty(int maxLength) {
+	struct decoder *dec = malloc(sizeof(struct decoder));
+	dec->entries = NULL;
+	dec->size = 0;
+	dec->capacity = 0;
+	dec->rootBits = maxLength;
+	if (dec->rootBits > DECODE_BITS) {
+		dec->rootBits = DECODE_BITS;
+	}
+	decoderAlloc(dec, dec->rootBits);
+	return dec;
+}
 
-// move crawler one branch down to the left
-static struct huffmanCrawler *crawlLeft(struct huffmanCrawler *crawl) {
-	struct huffmanCrawler *newCrawler = crawlerCopy(crawl);
-	newCrawler->tree = newCrawler->tree->left;
-	prefixPathRecord(newCrawler->address, ENCODING_0, NULL);
-	return newCrawler;
+// copy the filled in root table into single, then pack the root table
+static void decoderFinish(struct decoder *dec) {
+	size_t rootSize = sizeof(struct decodeEntry) << dec->rootBits;
+	dec->single = malloc(rootSize);
+	memcpy(dec->single, dec->entries, rootSize);
+	decoderPack(dec);
 }
 
-// move crawler one branch down to the right
-static struct huffmanCrawler *crawlRight(struct huffmanCrawler *crawl) {
-	struct huffmanCrawler *newCrawler = crawlerCopy(crawl);
-	newCrawler->tree = newCrawler->tree->right;
-	prefixPathRecord(newCrawler->address, ENCODING_1, NULL);
-	return newCrawler;
+// reserve a table of 2^width entries, returning its offset.
+// offsets stay valid when the entries are reallocated.
+static uint32_t decoderAlloc(struct decoder *dec, int width) {
+	uint32_t base = dec->size;
+	dec->size += 1u << width;
+	if (dec->size > dec->capacity) {
+		while (dec->size > dec->capacity) {
+			dec->capacity = dec->capacity == 0 ? 1024 : dec->capacity * 2;
+		}
+		struct decodeEntry *resize =
+		    realloc(dec->entries, sizeof(struct decodeEntry) * dec->capacity);
+		assert(resize != NULL);
+		dec->entries = resize;
+	}
+	// unused bytes are zeroed, so tables written to model files are the
+	// same every time
+	memset(&dec->entries[base], 0, sizeof(struct decodeEntry) << width);
+	return base;
 }
 
-// copy crawler instance
-static struct huffmanCrawler *crawlerCopy(struct huffmanCrawler *crawl) {
-	struct huffmanCrawler *copy = malloc(sizeof(struct huffmanCrawler));
-	copy->next = NULL;
-	copy->address = prefixPathCopy(crawl->address);
-	copy->tree = crawl->tree;
-	return copy;
+// fill in the root table and every subtable for the nodes of tree.
+// a leaf covers every index starting with its prefix, and an internal
+// node reached after all width bits of a table gets its own subtable.
+// nodes are visited with an explicit stack rather than recursion, so
+// trees of any depth are fine.
+static void decoderFill(struct decoder *dec, struct flatTree *tree) {
+	// only the right child of each node on the current path waits on
+	// the stack, so it never holds more than one node per level
+	struct pendingFill *stack =
+	    malloc(sizeof(struct pendingFill) * (tree->nodes[0].height + 1));
+	uint32_t size = 0;
+	stack[size++] = (struct pendingFill){0, dec->rootBits, 0, 0, 0};
+	while (size > 0) {
+		struct pendingFill next = stack[--size];
+		struct flatNode *n = &tree->nodes[next.node];
+		int width = next.width;
+		if (n->left == 0) {
+			uint32_t span = 1u << (width - next.depth);
+			uint32_t start = next.base + (next.prefix << (width - next.depth));
+			for (uint32_t ix = start; ix < start + span; ix++) {
+				struct decodeEntry *e = &dec->entries[ix];
+				e->bits = next.depth;
+				e->len = n->len;
+				e->width = 0;
+				memcpy(e->out, n->character, n->len);
+				e->next = 0;
+			}
+		} else if (next.depth == width) {
+			int subWidth = n->height;
+			if (subWidth > DECODE_BITS) {
+				subWidth = DECODE_BITS;
+			}
+			uint32_t sub = decoderAlloc(dec, subWidth);
+			struct decodeEntry *e = &dec->entries[next.base + next.prefix];
+			e->bits = width;
+			e->len = 0;
+			e->width = subWidth;
+			e->next = sub;
+			stack[size++] =
+			    (struct pendingFill){sub, subWidth, next.node, 0, 0};
+		} else {
+			stack[size++] =
+			    (struct pendingFill){next.base, width, n->right, next.depth + 1,
+			                         (next.prefix << 1) | 1};
+			stack[size++] =
+			    (struct pendingFill){next.base, width, n->left, next.depth + 1,
+			                         next.prefix << 1};
+		}
+	}
+	free(stack);
 }
 
-// implementation of prefixPath functions
+// fill in the table at base for count symbols of a canonical code,
+// whose codes all start with the same depth bits. the table is indexed
+// by the width bits after those. the symbols are in canonical order,
+// so symbols sharing the next width bits are next to each other, with
+// the longest code last.
+static void decoderFillCanonical(struct decoder *dec, uint32_t base,
+                                 int width, struct canonicalSymbol *symbols,
+                                 int count, int depth) {
+	int ix = 0;
+	while (ix < count) {
+		struct canonicalSymbol *sym = &symbols[ix];
+		int rest = sym->length - depth;
+		if (rest <= width) {
+			uint64_t code = canonicalBits(sym, depth, rest);
+			uint32_t span = 1u << (width - rest);
+			uint32_t start = base + (code << (width - rest));
+			for (uint32_t entry = start; entry < start + span; entry++) {
+				struct decodeEntry *e = &dec->entries[entry];
+				e->bits = rest;
+				e->len = sym->len;
+				e->width = 0;
+				memcpy(e->out, sym->character, sym->len);
+				e->next = 0;
+			}
+			ix++;
+			continue;
+		}
 
-// create an empty prefixPath structure
-static struct prefixPath *prefixPathNew() {
-	struct prefixPath *path = malloc(sizeof(struct prefixPath));
-	path->head = NULL;
-	path->length = 0;
-	path->tail = NULL;
-	return path;
+		// the symbols whose codes continue past this table
+		uint64_t prefix = canonicalBits(sym, depth, width);
+		int end = ix + 1;
+		while (end < count &&
+		       canonicalBits(&symbols[end], depth, width) == prefix) {
+			end++;
+		}
+		int subWidth = symbols[end - 1].length - depth - width;
+		if (subWidth > DECODE_BITS) {
+			subWidth = DECODE_BITS;
+		}
+		uint32_t sub = decoderAlloc(dec, subWidth);
+		struct decodeEntry *e = &dec->entries[base + prefix];
+		e->bits = width;
+		e->len = 0;
+		e->width = subWidth;
+		e->next = sub;
+		decoderFillCanonical(dec, sub, subWidth, &symbols[ix], end - ix,
+		                     depth + width);
+		ix = end;
+	}
 }
 
-// free entire prefixPath
-static void prefixPathFree(struct prefixPath *path) {
-	PrefixNode *currentNode = path->head;
-	while (currentNode != NULL) {
-		PrefixNode *trash = currentNode;
-		currentNode = currentNode->next;
-		if (trash->finalChar != NULL) {
-			free(trash->finalChar);
+// let root table entries emit as many whole characters as their
+// index determines, so short codes are decoded several at a time.
+static void decoderPack(struct decoder *dec) {
+	int width = dec->rootBits;
+	uint32_t mask = (1u << width) - 1;
+	for (uint32_t ix = 0; ix <= mask; ix++) {
+		struct decodeEntry *e = &dec->entries[ix];
+		if (e->len == 0) {
+			continue;
+		}
+		while (e->bits < width) {
+			struct decodeEntry *next = &dec->single[(ix << e->bits) & mask];
+			if (next->len == 0 || next->bits > width - e->bits ||
+			    e->len + next->len > DECODE_OUT_LEN) {
+				break;
+			}
+			memcpy(e->out + e->len, next->out, next->len);
+			e->len += next->len;
+			e->bits += next->bits;
 		}
-		free(trash);
 	}
-	free(path);
 }
 
-// generate an encoder for a specific character based on recorded
-// path
-static struct encoder *prefixPathEncoding(struct prefixPath *path) {
-	assert(path->tail->finalChar != NULL);
-	struct encoder *newEncoding = malloc(sizeof(struct encoder));
-	newEncoding->charSum = characterSum(path->tail->finalChar);
-	newEncoding->encoding = malloc(path->length);
-	unsigned int ix = 0;
-	for (PrefixNode *n = path->head; n != NULL; n = n->next) {
-		if (n->dir == ENCODING_END) {
-			newEncoding->encoding[ix] = '\0';
-		} else {
-			newEncoding->encoding[ix] = n->dir;
+// decode every complete code in the reader and write it to out.
+// output is gathered into a chunk and written out whenever it fills up.
+static void decoderRun(struct decoder *dec, struct bitReader *r,
+                       struct decodeOutput *out) {
+	char *chunk = malloc(WRITE_CHUNK_LEN);
+	size_t size = 0;
+	while (true) {
+		int avail = bitReaderFill(r);
+		if (avail == 0) {
+			break;
+		}
+
+		uint32_t index = bitReaderPeek(r, dec->rootBits);
+		struct decodeEntry *e = &dec->entries[index];
+		if (e->bits > avail) {
+			// packed entries may run past the end of the encoding
+			e = &dec->single[index];
+		}
+		while (e->len == 0 && e->bits <= avail) {
+			bitReaderSkip(r, e->bits);
+			avail = bitReaderFill(r);
+			e = &dec->entries[e->next + bitReaderPeek(r, e->width)];
+		}
+		if (e->bits > avail) {
+			// trailing bits that do not form a whole code
+			break;
 		}
-		ix++;
+
+		// copying the whole entry is cheaper than copying e->len bytes
+		if (size > WRITE_CHUNK_LEN - DECODE_OUT_LEN) {
+			decodeOutputWrite(out, chunk, size);
+			size = 0;
+		}
+		memcpy(chunk + size, e->out, DECODE_OUT_LEN);
+		size += e->len;
+		bitReaderSkip(r, e->bits);
 	}
-	newEncoding->encodingLength = path->length;
-	assert(newEncoding->encoding[path->length - 1] == '\0');
-	return newEncoding;
+	decodeOutputWrite(out, chunk, size);
+	free(chunk);
 }
 
-// update the path when traversing down a tree
-static void prefixPathRecord(struct prefixPath *path, char dir,
-                             char *finalChar) {
-	// create the new node
-	PrefixNode *newPathNode = malloc(sizeof(PrefixNode));
-	newPathNode->dir = dir;
-	newPathNode->next = NULL;
-	if (finalChar != NULL) {
-		newPathNode->finalChar = malloc(MAX_CHARACTER_LEN + 1);
-		strncpy(newPathNode->finalChar, finalChar, MAX_CHARACTER_LEN + 1);
+// pass on len bytes of decoded text.
+// exits if more text is decoded than there is room for.
+static void decodeOutputWrite(struct decodeOutput *out, char *bytes,
+                              size_t len) {
+	if (out->file != NULL) {
+		FileWriteBytes(out->file, bytes, len);
+	} else if (len > out->len - out->size) {
+		fprintf(stderr, "error: block index does not match the encoding\n");
+		exit(EXIT_FAILURE);
 	} else {
-		newPathNode->finalChar = NULL;
+		memcpy(out->dest + out->size, bytes, len);
 	}
+	out->size += len;
+}
 
-	// add node to linked list.
-	if (path->head == NULL) {
-		path->head = newPathNode;
-		path->tail = newPathNode;
-	} else {
-		path->tail->next = newPathNode;
-		path->tail = path->tail->next;
+// free decode tables, if there are any
+static void decoderFree(struct decoder *dec) {
+	if (dec == NULL) {
+		return;
 	}
+	free(dec->entries);
+	free(dec->single);
+	free(dec);
+}
 
-	path->length++;
+// Task 3
+struct huffmanTree *createHuffmanTree(char *inputFilename) {
+	File fstream = FileOpenToRead(inputFilename);
+	struct huffmanTree *tree = createHuffmanTreeStream(fstream);
+	FileClose(fstream);
+	return tree;
 }
 
-// create a copy of a prefix path
-static struct prefixPath *prefixPathCopy(struct prefixPath *orig) {
-	struct prefixPath *copy = prefixPathNew();
-	PrefixNode *origPointer = orig->head;
-	while (origPointer != NULL) {
-		prefixPathRecord(copy, origPointer->dir, origPointer->finalChar);
-		origPointer = origPointer->next;
-	}
-	return copy;
+// create a huffman tree from everything left in fstream
+struct huffmanTree *createHuffmanTreeStream(File fstream) {
+	Counter charCount = countStream(fstream);
+	int distinctCharCount = 0;
+	struct item *fileCharData = CounterItems(charCount, &distinctCharCount);
+	struct huffmanTree *tree =
+	    huffmanTreeFromItems(fileCharData, distinctCharCount);
+	free(fileCharData);
+	CounterFree(charCount);
+	return tree;
 }
 
-// implementation of buffer functions
+// create a huffman tree from everything left in fstream, with codes of
+// at most maxLength bits. the huffman tree is kept if its codes are short
+// enough, and otherwise the code lengths are chosen by package-merge.
+struct huffmanTree *createLimitedHuffmanTreeStream(File fstream,
+                                                   int maxLength,
+                                                   uint64_t *optimalBits,
+                                                   uint64_t *limitedBits) {
+	Counter charCount = countStream(fstream);
+	int distinctCharCount = 0;
+	struct item *fileCharData = CounterItems(charCount, &distinctCharCount);
+	struct huffmanTree *tree =
+	    huffmanTreeFromItems(fileCharData, distinctCharCount);
+	*optimalBits = tree == NULL ? 0 : treeCost(tree, 0);
+	assert(maxLength > 0);
+	if (tree != NULL && treeHeight(tree) - 1 > maxLength) {
+		if (maxLength < 31 && distinctCharCount > 1 << maxLength) {
+			fprintf(stderr, "error: %d characters do not fit in codes of "
+			                "at most %d bits\n",
+			        distinctCharCount, maxLength);
+			exit(EXIT_FAILURE);
+		}
+		freeTree(tree);
 
-// create a new buffer with an initial size.
-struct buffer *bufferInit(size_t size) {
-	struct buffer *nBuf = malloc(sizeof(struct buffer));
-	nBuf->charCount = 0;
-	nBuf->capacity = size;
-	nBuf->str = malloc(nBuf->capacity);
-	return nBuf;
+		// build the tree of the canonical code with the chosen lengths
+		uint64_t *weights = malloc(sizeof(uint64_t) * distinctCharCount);
+		for (int ix = 0; ix < distinctCharCount; ix++) {
+			weights[ix] = fileCharData[ix].freq;
+		}
+		int *lengths = packageMerge(weights, distinctCharCount, maxLength);
+		struct canonicalCode code;
+		code.symbols =
+		    malloc(sizeof(struct canonicalSymbol) * distinctCharCount);
+		code.count = distinctCharCount;
+		code.bytes = false;
+		for (int ix = 0; ix < distinctCharCount; ix++) {
+			struct canonicalSymbol *sym = &code.symbols[ix];
+			strncpy(sym->character, fileCharData[ix].character,
+			        MAX_CHARACTER_LEN + 1);
+			sym->len = strlen(sym->character);
+			sym->length = lengths[ix];
+		}
+		canonicalAssign(&code);
+		tree = canonicalTree(&code);
+		treeSetFreq(tree, charCount);
+		free(code.symbols);
+		free(lengths);
+		free(weights);
+	}
+	*limitedBits = tree == NULL ? 0 : treeCost(tree, 0);
+	free(fileCharData);
+	CounterFree(charCount);
+	return tree;
 }
 
-// insert to buffer, resizing the string allocation if necessary
-static void bufferInsert(struct buffer *buf, char *chars, unsigned int len) {
-	unsigned int newCount = buf->charCount + len;
-	if (newCount >= buf->capacity) {
-		buf->capacity *= buf->capacity;
-		char *resize = realloc(buf->str, buf->capacity);
-		assert(resize != NULL);
-		buf->str = resize;
+// count the characters left in fstream.
+// if the input is in memory, it is split between threads which count
+// their piece separately, and the counts are merged afterwards.
+static Counter countStream(File fstream) {
+	Counter charCount = CounterNew();
+	size_t textLen;
+	char *text = FileReadRest(fstream, &textLen);
+	int threads = text == NULL ? 1 : threadCount(textLen);
+	if (text == NULL) {
+		// generate count tree.
+		char charUtf8[MAX_CHARACTER_LEN + 1];
+		char *character;
+		int len;
+		while ((len = FileNextCharacter(fstream, &character)) > 0) {
+			memcpy(charUtf8, character, len);
+			charUtf8[len] = '\0';
+			CounterAdd(charCount, charUtf8);
+		}
+	} else if (threads == 1) {
+		if (!countCharacters(charCount, text, textLen)) {
+			fprintf(stderr, "error: invalid character\n");
+		}
+	} else {
+		struct countJob *jobs = malloc(sizeof(struct countJob) * threads);
+		for (int ix = 0; ix < threads; ix++) {
+			size_t start = splitText(text, textLen, ix, threads);
+			size_t end = splitText(text, textLen, ix + 1, threads);
+			jobs[ix].text = text + start;
+			jobs[ix].len = end - start;
+			jobs[ix].counter = CounterNew();
+		}
+		runJobs(countJobRun, jobs, sizeof(struct countJob), threads);
+		bool valid = true;
+		for (int ix = 0; ix < threads; ix++) {
+			CounterMerge(charCount, jobs[ix].counter);
+			CounterFree(jobs[ix].counter);
+			valid = valid && jobs[ix].valid;
+		}
+		if (!valid) {
+			// counting has to stop at the first invalid character,
+			// so start over in one go.
+			CounterFree(charCount);
+			charCount = CounterNew();
+			countCharacters(charCount, text, textLen);
+			fprintf(stderr, "error: invalid character\n");
+		}
+		free(jobs);
 	}
-	// using strncat is very slow, so we do the ff instead
-	for (unsigned int ix = 0; ix < len; ix++) {
-		buf->str[buf->charCount + ix] = chars[ix];
+	return charCount;
+}
+
+// create a huffman tree from the counted characters,
+// or return NULL if there are none
+static struct huffmanTree *huffmanTreeFromItems(struct item *fileCharData,
+                                                int distinctCharCount) {
+	// create an array of huffman trees, each containing one character and a
+	// frequncy.
+	if (distinctCharCount == 0) {
+		return NULL;
 	}
+	struct huffmanHeap *heap = huffmanHeapNew(distinctCharCount);
+	for (int index = 0; index < distinctCharCount; index++) {
+		struct huffmanTree *tree = huffmanTreeFromItem(fileCharData[index]);
+		huffmanHeapAdd(heap, tree);
+	}
+
+	while (heap->size != 1) {
+		struct huffmanTree *newBiggerTree = malloc(sizeof(struct huffmanTree));
+		struct huffmanTree *lowestFirst = huffmanHeapPop(heap);
+		struct huffmanTree *lowestSecond = huffmanHeapPop(heap);
+
+		newBiggerTree->character = NULL;
+		newBiggerTree->freq = lowestFirst->freq + lowestSecond->freq;
+		newBiggerTree->left = lowestFirst;
+		newBiggerTree->right = lowestSecond;
+
+		huffmanHeapAdd(heap, newBiggerTree);
+	}
+	struct huffmanTree *finalTree = huffmanHeapPop(heap);
+
+	huffmanHeapFree(heap);
+	return finalTree;
+}
+
+// choose code lengths of at most maxLength bits for count characters
+// with the given weights, which give the shortest encoding of the
+// counted text, by package-merge. count must be at least 2, and at most
+// 2^maxLength. returns the code length of each character, in the same
+// order as weights.
+// the lists are only needed while choosing, so they live in an arena.
+static int *packageMerge(uint64_t *weights, int count, int maxLength) {
+	// no code is ever longer than count - 1 bits
+	if (maxLength > count - 1) {
+		maxLength = count - 1;
+	}
+	struct arena *arena = arenaNew();
+	struct mergeItem *leaves =
+	    arenaAlloc(arena, sizeof(struct mergeItem) * count);
+	for (int ix = 0; ix < count; ix++) {
+		leaves[ix].weight = weights[ix];
+		leaves[ix].symbol = ix;
+	}
+	qsort(leaves, count, sizeof(struct mergeItem), mergeItemCompare);
+
+	// the first list is the characters, and each list after it merges
+	// them with packages of adjacent pairs of the list before
+	struct mergeItem **lists =
+	    arenaAlloc(arena, sizeof(struct mergeItem *) * maxLength);
+	int *sizes = arenaAlloc(arena, sizeof(int) * maxLength);
+	lists[0] = leaves;
+	sizes[0] = count;
+	for (int level = 1; level < maxLength; level++) {
+		struct mergeItem *prev = lists[level - 1];
+		int packages = sizes[level - 1] / 2;
+		struct mergeItem *list =
+		    arenaAlloc(arena, sizeof(struct mergeItem) * (count + packages));
+		int leaf = 0;
+		int package = 0;
+		int size = 0;
+		while (leaf < count || package < packages) {
+			uint64_t weight = 0;
+			if (package < packages) {
+				weight =
+				    prev[2 * package].weight + prev[2 * package + 1].weight;
+			}
+			if (package == packages ||
+			    (leaf < count && leaves[leaf].weight <= weight)) {
+				list[size++] = leaves[leaf++];
+			} else {
+				list[size].weight = weight;
+				list[size++].symbol = -1;
+				package++;
+			}
+		}
+		lists[level] = list;
+		sizes[level] = size;
+	}
+
+	// take the lightest 2 * count - 2 items of the last list. each
+	// character taken gets one bit longer, and the packages taken are
+	// made from the lightest items of the list before, which are taken
+	// in turn.
+	int *lengths = calloc(count, sizeof(int));
+	int take = 2 * count - 2;
+	for (int level = maxLength - 1; level >= 0; level--) {
+		assert(take <= sizes[level]);
+		int packages = 0;
+		for (int ix = 0; ix < take; ix++) {
+			if (lists[level][ix].symbol < 0) {
+				packages++;
+			} else {
+				lengths[lists[level][ix].symbol]++;
+			}
+		}
+		take = 2 * packages;
+	}
+	arenaFree(arena);
+	return lengths;
+}
+
+// order package-merge items by weight, then by character
+static int mergeItemCompare(const void *a, const void *b) {
+	const struct mergeItem *itemA = a;
+	const struct mergeItem *itemB = b;
+	if (itemA->weight != itemB->weight) {
+		return itemA->weight < itemB->weight ? -1 : 1;
+	}
+	return itemA->symbol - itemB->symbol;
+}
+
+// build the tree whose leaves are at the codes of a canonical code.
+// every node has a frequency of 0.
+static struct huffmanTree *canonicalTree(struct canonicalCode *code) {
+	struct huffmanTree *root = huffmanTreeNode();
+	for (int ix = 0; ix < code->count; ix++) {
+		struct canonicalSymbol *sym = &code->symbols[ix];
+		struct huffmanTree *node = root;
+		for (int bit = sym->length - 1; bit >= 0; bit--) {
+			struct huffmanTree **child =
+			    (sym->code >> bit) & 1 ? &node->right : &node->left;
+			if (*child == NULL) {
+				*child = huffmanTreeNode();
+			}
+			node = *child;
+		}
+		node->character = malloc(MAX_CHARACTER_LEN + 1);
+		strncpy(node->character, sym->character, MAX_CHARACTER_LEN + 1);
+	}
+	return root;
+}
+
+// create a tree node with no character and no children
+static struct huffmanTree *huffmanTreeNode(void) {
+	struct huffmanTree *node = malloc(sizeof(struct huffmanTree));
+	node->character = NULL;
+	node->freq = 0;
+	node->left = NULL;
+	node->right = NULL;
+	return node;
+}
+
+// set the frequency of every leaf from the counter, and of every other
+// node to the sum of its children's. returns the tree's frequency.
+static int treeSetFreq(struct huffmanTree *tree, Counter counter) {
+	if (isLeaf(tree)) {
+		tree->freq = CounterGet(counter, tree->character);
+	} else {
+		tree->freq = treeSetFreq(tree->left, counter) +
+		             treeSetFreq(tree->right, counter);
+	}
+	return tree->freq;
+}
+
+// the number of bits needed to encode the text the tree was built from,
+// where the tree is depth levels down
+static uint64_t treeCost(struct huffmanTree *tree, int depth) {
+	if (isLeaf(tree)) {
+		return (uint64_t)tree->freq * depth;
+	}
+	return treeCost(tree->left, depth + 1) + treeCost(tree->right, depth + 1);
+}
+
+// free a tree along with its characters
+static void freeTree(struct huffmanTree *tree) {
+	if (tree != NULL) {
+		freeTree(tree->left);
+		freeTree(tree->right);
+		free(tree->character);
+		free(tree);
+	}
+}
+
+// helper functions
+
+// set the number of threads used to count and encode characters.
+// 0 uses one thread per online processor.
+void setHuffmanThreads(int threads) {
+	huffmanThreads = threads;
+}
+
+// the number of threads to split len bytes of input between
+static int threadCount(size_t len) {
+	long threads = huffmanThreads;
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if ((size_t)threads > len / MIN_THREAD_CHUNK_LEN) {
+		threads = len / MIN_THREAD_CHUNK_LEN;
+	}
+	return threads < 1 ? 1 : threads;
+}
+
+// run count jobs of jobSize bytes each on their own thread,
+// returning once they have all finished
+static void runJobs(void *(*run)(void *), void *jobs, size_t jobSize,
+                    int count) {
+	pthread_t *ids = malloc(sizeof(pthread_t) * count);
+	for (int ix = 0; ix < count; ix++) {
+		if (pthread_create(&ids[ix], NULL, run,
+		                   (char *)jobs + jobSize * ix) != 0) {
+			fprintf(stderr, "error: failed to start a thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int ix = 0; ix < count; ix++) {
+		pthread_join(ids[ix], NULL);
+	}
+	free(ids);
+}
+
+// the offset at which piece starts when splitting text into pieces.
+// offsets are moved forward to the start of a character.
+static size_t splitText(char *text, size_t len, int piece, int pieces) {
+	if (piece == pieces) {
+		return len;
+	}
+	size_t offset = len / pieces * piece;
+	while (offset < len && (text[offset] & 0b11000000) == 0b10000000) {
+		offset++;
+	}
+	return offset;
+}
+
+// thread entry point for counting a piece of the input
+static void *countJobRun(void *arg) {
+	struct countJob *job = arg;
+	job->valid = countCharacters(job->counter, job->text, job->len);
+	return NULL;
+}
+
+// count the characters in len bytes of text.
+// stops at the first invalid character and returns false.
+static bool countCharacters(Counter counter, char *text, size_t len) {
+	char charUtf8[MAX_CHARACTER_LEN + 1];
+	size_t pos = 0;
+	while (pos < len) {
+		int charLen = FileCharacterLength(text[pos]);
+		if (charLen == 0 || len - pos < (size_t)charLen) {
+			return false;
+		}
+		memcpy(charUtf8, &text[pos], charLen);
+		charUtf8[charLen] = '\0';
+		CounterAdd(counter, charUtf8);
+		pos += charLen;
+	}
+	return true;
+}
+
+// the number of bytes in a symbol encoded with table, given its first
+// byte: one for a byte code, and otherwise the length of a character
+static int symbolLength(struct codeTable *table, unsigned char byte1) {
+	return table->bytes ? 1 : FileCharacterLength(byte1);
+}
+
+// create a leaf huffmanTree from item struct
+static struct huffmanTree *huffmanTreeFromItem(struct item item) {
+	struct huffmanTree *newTree = malloc(sizeof(struct huffmanTree));
+	newTree->character = malloc(sizeof(char) * (MAX_CHARACTER_LEN + 1));
+	strncpy(newTree->character, item.character, MAX_CHARACTER_LEN + 1);
+	newTree->freq = item.freq;
+	newTree->left = NULL;
+	newTree->right = NULL;
+	return newTree;
+}
+
+// initialise a huffmanHeap with room for capacity trees.
+// merging two trees into one never grows the heap, so it needs no more.
+static struct huffmanHeap *huffmanHeapNew(int capacity) {
+	struct huffmanHeap *heap = malloc(sizeof(struct huffmanHeap));
+	heap->entries = malloc(sizeof(struct huffmanHeapEntry) * capacity);
+	heap->size = 0;
+	heap->added = 0;
+	return heap;
+}
+
+// free heap
+// this must be done once the full tree is completed
+// asserts that there are no trees inside.
+static void huffmanHeapFree(struct huffmanHeap *heap) {
+	assert(heap->size == 0);
+	free(heap->entries);
+	free(heap);
+}
+
+// add a tree to the heap, sifting it up into place
+static void huffmanHeapAdd(struct huffmanHeap *heap,
+                           struct huffmanTree *tree) {
+	struct huffmanHeapEntry entry = {tree, heap->added++};
+	int ix = heap->size++;
+	while (ix > 0) {
+		int parent = (ix - 1) / 2;
+		if (!huffmanHeapLess(&entry, &heap->entries[parent])) {
+			break;
+		}
+		heap->entries[ix] = heap->entries[parent];
+		ix = parent;
+	}
+	heap->entries[ix] = entry;
+}
+
+// remove and return the tree with the lowest frequency
+static struct huffmanTree *huffmanHeapPop(struct huffmanHeap *heap) {
+	struct huffmanTree *popped = heap->entries[0].tree;
+	struct huffmanHeapEntry last = heap->entries[--heap->size];
+
+	// sift the last entry down from the root
+	int ix = 0;
+	while (true) {
+		int child = 2 * ix + 1;
+		if (child >= heap->size) {
+			break;
+		}
+		if (child + 1 < heap->size &&
+		    huffmanHeapLess(&heap->entries[child + 1],
+		                    &heap->entries[child])) {
+			child++;
+		}
+		if (!huffmanHeapLess(&heap->entries[child], &last)) {
+			break;
+		}
+		heap->entries[ix] = heap->entries[child];
+		ix = child;
+	}
+	heap->entries[ix] = last;
+	return popped;
+}
+
+// whether entry a should be popped before entry b
+static bool huffmanHeapLess(struct huffmanHeapEntry *a,
+                            struct huffmanHeapEntry *b) {
+	if (a->tree->freq != b->tree->freq) {
+		return a->tree->freq < b->tree->freq;
+	}
+	return a->order < b->order;
+}
+
+// Task 4
+char *encode(struct huffmanTree *tree, char *inputFilename) {
+	// initial data
+	File fstream = FileOpenToReread(inputFilename);
+	char *character;
+	int len;
+	struct flatTree *flat = flatTreeNew(tree);
+	struct codeTable *table = codeTableNew(flat);
+	flatTreeFree(flat);
+
+	// count the characters first, so the buffer can be allocated
+	// with exactly the length of the encoding
+	Counter charCount = countStream(fstream);
+	struct buffer *buf = bufferInit(codeTableCost(table, charCount) + 1);
+	CounterFree(charCount);
+	FileRewind(fstream);
+
+	// encode the entire text in file onto one massive string.
+	while ((len = FileNextCharacter(fstream, &character)) > 0) {
+		struct encoder *enc =
+		    codeTableFind(table, characterKey(character, len));
+		bufferInsertCode(buf, table, enc);
+	}
+
+	char *result = bufferGetStr(buf);
+
+	// cleanup :)
+	codeTableFree(table);
+	bufferFree(buf);
+	FileClose(fstream);
+	return result;
+}
+
+// implementation of huffmanModel functions
+
+// create the model of tree
+HuffmanModel HuffmanModelNew(struct huffmanTree *tree) {
+	HuffmanModel model = malloc(sizeof(struct huffmanModel));
+	model->flat = flatTreeNew(tree);
+	model->table = NULL;
+	model->dec = decoderNew(model->flat);
+	model->file = NULL;
+	return model;
+}
+
+// create the model of a canonical code
+HuffmanModel HuffmanModelNewCanonical(CanonicalCode code) {
+	HuffmanModel model = malloc(sizeof(struct huffmanModel));
+	model->table = codeTableNewCanonical(code);
+	model->dec = decoderNewCanonical(code);
+	model->flat = NULL;
+	model->file = NULL;
+	return model;
+}
+
+// create the model of the huffman tree of the characters in counter
+HuffmanModel HuffmanModelNewCounts(Counter counter) {
+	int count = 0;
+	struct item *items = CounterItems(counter, &count);
+	struct huffmanTree *tree = huffmanTreeFromItems(items, count);
+	free(items);
+	if (tree == NULL) {
+		fprintf(stderr, "error: a model needs at least one character\n");
+		exit(EXIT_FAILURE);
+	}
+	HuffmanModel model = HuffmanModelNew(tree);
+	freeTree(tree);
+	return model;
+}
+
+// encode a file with the model's codes, writing the encoding to out as
+// it goes, and its block index to index if it is not NULL.
+void HuffmanModelEncode(HuffmanModel model, File in, File out,
+                        enum encodingFormat format, File index,
+                        int blockLen) {
+	encodeWith(modelTable(model), in, out, format, index, blockLen);
+}
+
+// decode the encoding in in with the model
+void HuffmanModelDecode(HuffmanModel model, File in, File out) {
+	decodeWith(model->dec, in, out);
+}
+
+// decode bytes from up to to of the text encoded in in with the model
+void HuffmanModelDecodeIndexed(HuffmanModel model, File in, File index,
+                               File out, size_t from, size_t to) {
+	decodeIndexedWith(model->dec, in, index, out, from, to);
+}
+
+// write the model's tables to out, after a header
+void HuffmanModelWrite(HuffmanModel model, File out) {
+	struct codeTable *table = modelTable(model);
+	struct decoder *dec = model->dec;
+	struct modelHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MODEL_MAGIC, MODEL_MAGIC_LEN);
+	header.byteOrder = MODEL_BYTE_ORDER;
+	header.encoderLen = sizeof(struct encoder);
+	header.entryLen = sizeof(struct decodeEntry);
+	header.count = table->count;
+	header.hashBits = table->hashBits;
+	header.bytes = table->bytes;
+	header.chunkCount = table->chunkCount;
+	size_t encodersLen =
+	    sizeof(struct encoder) * (DIRECT_KEYS + table->mask + 1);
+	size_t chunksLen = sizeof(struct codeChunk) * table->chunkCount;
+	header.encodersOffset = sizeof(header);
+	header.chunksOffset = header.encodersOffset + encodersLen;
+	header.entriesOffset = header.chunksOffset + chunksLen;
+	header.singleOffset = header.entriesOffset;
+	if (dec != NULL) {
+		header.rootBits = dec->rootBits;
+		header.decodeSize = dec->size;
+		header.singleOffset += sizeof(struct decodeEntry) * dec->size;
+	}
+
+	FileWriteBytes(out, (char *)&header, sizeof(header));
+	FileWriteBytes(out, (char *)table->direct, encodersLen);
+	if (table->chunkCount > 0) {
+		FileWriteBytes(out, (char *)table->chunks, chunksLen);
+	}
+	if (dec != NULL) {
+		FileWriteBytes(out, (char *)dec->entries,
+		               sizeof(struct decodeEntry) * dec->size);
+		FileWriteBytes(out, (char *)dec->single,
+		               sizeof(struct decodeEntry) << dec->rootBits);
+	}
+}
+
+// load a model written by HuffmanModelWrite, using its tables straight
+// from file, which is mapped into memory if it is a regular file.
+// returns NULL, with file rewound, if it does not hold a model.
+HuffmanModel HuffmanModelLoad(File file) {
+	size_t len;
+	char *bytes = FileReadRest(file, &len);
+	if (len < MODEL_MAGIC_LEN ||
+	    memcmp(bytes, MODEL_MAGIC, MODEL_MAGIC_LEN) != 0) {
+		FileRewind(file);
+		return NULL;
+	}
+	struct modelHeader *header = (struct modelHeader *)bytes;
+	if (!modelHeaderValid(header, len)) {
+		fprintf(stderr, "error: model was written by a different machine "
+		                "or is corrupt\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct codeTable *table = malloc(sizeof(struct codeTable));
+	table->encoders = NULL;
+	table->count = header->count;
+	table->direct = (struct encoder *)(bytes + header->encodersOffset);
+	table->slots = table->direct + DIRECT_KEYS;
+	table->hashBits = header->hashBits;
+	table->bytes = header->bytes;
+	table->mask = (1u << table->hashBits) - 1;
+	table->chunks = (struct codeChunk *)(bytes + header->chunksOffset);
+	table->chunkCount = header->chunkCount;
+	struct decoder *dec = NULL;
+	if (header->decodeSize > 0) {
+		dec = malloc(sizeof(struct decoder));
+		dec->entries = (struct decodeEntry *)(bytes + header->entriesOffset);
+		dec->single = (struct decodeEntry *)(bytes + header->singleOffset);
+		dec->rootBits = header->rootBits;
+		dec->size = header->decodeSize;
+		dec->capacity = dec->size;
+	}
+	if (!modelTablesValid(table, dec)) {
+		fprintf(stderr, "error: model is corrupt\n");
+		exit(EXIT_FAILURE);
+	}
+
+	HuffmanModel model = malloc(sizeof(struct huffmanModel));
+	model->table = table;
+	model->dec = dec;
+	model->flat = NULL;
+	model->file = file;
+	return model;
+}
+
+// load or build the model of a tree file, which holds either
+// a precompiled model, a canonical code (or byte code) or a whole tree.
+// the file is opened once and held in memory, so that it can be tried
+// as each of them in turn even if it is a pipe.
+HuffmanModel HuffmanModelRead(char *filename) {
+	File file = FileOpenToReread(filename);
+	HuffmanModel model = HuffmanModelLoad(file);
+	if (model != NULL) {
+		// the model's tables lie in the file
+		return model;
+	}
+	CanonicalCode code = CanonicalCodeRead(file);
+	if (code != NULL) {
+		model = HuffmanModelNewCanonical(code);
+		CanonicalCodeFree(code);
+	} else {
+		struct huffmanTree *tree = readHuffmanTreeFile(file);
+		model = HuffmanModelNew(tree);
+		free(tree);
+	}
+	FileClose(file);
+	return model;
+}
+
+void HuffmanModelFree(HuffmanModel model) {
+	if (model->file != NULL) {
+		// the tables belong to the file
+		free(model->table);
+		free(model->dec);
+		FileClose(model->file);
+	} else {
+		if (model->table != NULL) {
+			codeTableFree(model->table);
+		}
+		decoderFree(model->dec);
+		if (model->flat != NULL) {
+			flatTreeFree(model->flat);
+		}
+	}
+	free(model);
+}
+
+// the code table of a model, which is built the first time it is needed
+static struct codeTable *modelTable(HuffmanModel model) {
+	if (model->table == NULL) {
+		model->table = codeTableNew(model->flat);
+	}
+	return model->table;
+}
+
+// implementation of model file functions
+
+// whether a model file of len bytes starting with header was written by
+// a machine laying out tables the same way, and holds all of them
+static bool modelHeaderValid(struct modelHeader *header, size_t len) {
+	if (len < sizeof(struct modelHeader) ||
+	    header->byteOrder != MODEL_BYTE_ORDER ||
+	    header->encoderLen != sizeof(struct encoder) ||
+	    header->entryLen != sizeof(struct decodeEntry) ||
+	    header->hashBits < 1 || header->hashBits > 30 || header->bytes > 1 ||
+	    header->rootBits > DECODE_BITS ||
+	    (header->decodeSize > 0 &&
+	     (header->rootBits < 1 ||
+	      header->decodeSize < (1u << header->rootBits)))) {
+		// the root table is the first part of the entries
+		return false;
+	}
+	uint64_t encodersLen = sizeof(struct encoder) *
+	                       (DIRECT_KEYS + ((uint64_t)1 << header->hashBits));
+	uint64_t chunksLen = sizeof(struct codeChunk) * header->chunkCount;
+	uint64_t entriesLen = sizeof(struct decodeEntry) * header->decodeSize;
+	uint64_t singleLen = header->decodeSize == 0
+	                         ? 0
+	                         : sizeof(struct decodeEntry) << header->rootBits;
+	return header->encodersOffset % ARENA_ALIGN == 0 &&
+	       header->chunksOffset % ARENA_ALIGN == 0 &&
+	       header->entriesOffset % ARENA_ALIGN == 0 &&
+	       header->singleOffset % ARENA_ALIGN == 0 &&
+	       header->encodersOffset >= sizeof(struct modelHeader) &&
+	       modelRegionValid(header->encodersOffset, encodersLen, len) &&
+	       modelRegionValid(header->chunksOffset, chunksLen, len) &&
+	       modelRegionValid(header->entriesOffset, entriesLen, len) &&
+	       modelRegionValid(header->singleOffset, singleLen, len);
+}
+
+// whether regionLen bytes at offset lie within a file of len bytes,
+// without adding them, so that huge offsets cannot wrap around
+static bool modelRegionValid(uint64_t offset, uint64_t regionLen,
+                             size_t len) {
+	return offset <= len && len - offset >= regionLen;
+}
+
+// whether the tables of a loaded model can be used without reading or
+// looping past their ends: every chunk but the last of a code is 64 bits
+// long and comes before the next, every code longer than 64 bits ends in
+// a chunk of the same length, the hash table has an empty slot, and every
+// decode entry consumes bits and links to a table that lies within the
+// entries.
+static bool modelTablesValid(struct codeTable *table, struct decoder *dec) {
+	for (uint32_t ix = 0; ix < table->chunkCount; ix++) {
+		struct codeChunk *chunk = &table->chunks[ix];
+		uint32_t start = 0;
+		if (chunk->prev != NO_CHUNK) {
+			if (chunk->prev >= ix || table->chunks[chunk->prev].length % 64) {
+				return false;
+			}
+			start = table->chunks[chunk->prev].length;
+		}
+		if (chunk->length <= start || chunk->length - start > 64) {
+			return false;
+		}
+	}
+	bool empty = false;
+	for (uint32_t ix = 0; ix < DIRECT_KEYS + table->mask + 1; ix++) {
+		struct encoder *enc = &table->direct[ix];
+		if (enc->length < -1 ||
+		    (enc->length > 64 &&
+		     (enc->bits >= table->chunkCount ||
+		      table->chunks[enc->bits].length != (uint32_t)enc->length))) {
+			return false;
+		}
+		empty = empty || (ix >= DIRECT_KEYS && enc->length == -1);
+	}
+	if (!empty || dec == NULL) {
+		return empty;
+	}
+
+	uint32_t rootSize = 1u << dec->rootBits;
+	for (uint32_t ix = 0; ix < dec->size + rootSize; ix++) {
+		struct decodeEntry *e = ix < dec->size ? &dec->entries[ix]
+		                                       : &dec->single[ix - dec->size];
+		if (e->bits < 1 || e->bits > DECODE_BITS ||
+		    e->len > DECODE_OUT_LEN) {
+			return false;
+		}
+		if (e->len == 0 && (e->width < 1 || e->width > DECODE_BITS ||
+		                    e->next > dec->size ||
+		                    dec->size - e->next < (1u << e->width))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// encode a file with the codes in table.
+// only a fixed size chunk of the encoding is held in memory.
+// packed encodings of inputs held in memory are split between threads.
+static void encodeWith(struct codeTable *table, File in, File out,
+                       enum encodingFormat format, File indexFile,
+                       int blockLen) {
+	char *character;
+	int len;
+	struct bitWriter *writer = bitWriterNew(out, format);
+	struct blockIndex *index = NULL;
+	if (indexFile != NULL) {
+		assert(blockLen > 0);
+		index = blockIndexNew(blockLen);
+	}
+	size_t textLen;
+	if (format == ENCODING_PACKED &&
+	    (character = FileReadRest(in, &textLen)) != NULL) {
+		encodeText(table, writer, index, character, textLen);
+	}
+	if (table->bytes) {
+		// every byte is a symbol, so bytes are taken a chunk at a time
+		char *chunk = malloc(READ_CHUNK_LEN);
+		while ((textLen = FileReadBytes(in, chunk, READ_CHUNK_LEN)) > 0) {
+			encodeSymbols(table, writer, index, chunk, textLen);
+		}
+		free(chunk);
+	}
+	while ((len = FileNextCharacter(in, &character)) > 0) {
+		struct encoder *enc =
+		    codeTableFind(table, characterKey(character, len));
+		if (index != NULL) {
+			blockIndexStep(index, writer->bitCount, len);
+		}
+		bitWriterPutCode(writer, table, enc);
+	}
+	bitWriterFinish(writer);
+
+	if (index != NULL) {
+		blockIndexAdd(index, writer->bitCount, index->symbols, index->bytes);
+		blockIndexWrite(index, indexFile);
+		blockIndexFree(index);
+	}
+	bitWriterFree(writer);
+}
+
+// encode len bytes of text held in memory into a packed writer,
+// splitting it between threads if it is large enough.
+// the result is exactly what encoding one character at a time gives.
+static void encodeText(struct codeTable *table, struct bitWriter *w,
+                       struct blockIndex *index, char *text, size_t len) {
+	int threads = threadCount(len);
+	if (threads == 1) {
+		encodeSymbols(table, w, index, text, len);
+		return;
+	}
+
+	// go through the text a window at a time to bound memory use
+	struct encodeJob *jobs = malloc(sizeof(struct encodeJob) * threads);
+	for (int ix = 0; ix < threads; ix++) {
+		jobs[ix].index =
+		    index == NULL ? NULL : blockIndexNew(index->blockLen);
+	}
+	size_t windowLen = (size_t)threads * ENCODE_THREAD_CHUNK_LEN;
+	size_t pos = 0;
+	while (pos < len) {
+		size_t end = len - pos <= windowLen ? len : pos + windowLen;
+		while (end < len && (text[end] & 0b11000000) == 0b10000000) {
+			end++;
+		}
+		if (!encodeWindow(table, w, index, jobs, threads, text + pos,
+		                  end - pos)) {
+			fprintf(stderr, "error: invalid character\n");
+			break;
+		}
+		pos = end;
+	}
+	for (int ix = 0; ix < threads; ix++) {
+		if (jobs[ix].index != NULL) {
+			blockIndexFree(jobs[ix].index);
+		}
+	}
+	free(jobs);
+}
+
+// encode len bytes of text held in memory one symbol at a time.
+// returns false if the text has an invalid character, in which case
+// only the text before it is encoded.
+static bool encodeSymbols(struct codeTable *table, struct bitWriter *w,
+                          struct blockIndex *index, char *text, size_t len) {
+	size_t pos = 0;
+	while (pos < len) {
+		int charLen = symbolLength(table, text[pos]);
+		if (charLen == 0 || len - pos < (size_t)charLen) {
+			fprintf(stderr, "error: invalid character\n");
+			return false;
+		}
+		struct encoder *enc =
+		    codeTableFind(table, characterKey(&text[pos], charLen));
+		if (index != NULL) {
+			blockIndexStep(index, w->bitCount, charLen);
+		}
+		bitWriterPutCode(w, table, enc);
+		pos += charLen;
+	}
+	return true;
+}
+
+// encode one window of text on several threads.
+// each thread measures the encoding of its piece, the pieces are given
+// bit offsets from those lengths, then each thread writes its piece at
+// its offset. returns false if the text has an invalid character, in
+// which case only the text before it is encoded.
+// blocks starting in each piece are indexed by its thread as it writes.
+static bool encodeWindow(struct codeTable *table, struct bitWriter *w,
+                         struct blockIndex *index, struct encodeJob *jobs,
+                         int threads, char *text, size_t len) {
+	for (int ix = 0; ix < threads; ix++) {
+		size_t start = splitText(text, len, ix, threads);
+		size_t end = splitText(text, len, ix + 1, threads);
+		jobs[ix].table = table;
+		jobs[ix].text = text + start;
+		jobs[ix].len = end - start;
+	}
+	runJobs(encodeJobMeasure, jobs, sizeof(struct encodeJob), threads);
+
+	// move whole bytes out of the writer, so what is left of it fits
+	// in the first byte of the window
+	int wholeBytes = w->count / 8;
+	bitWriterEmit(w, wholeBytes);
+	w->acc <<= 8 * wholeBytes;
+	w->count -= 8 * wholeBytes;
+
+	// work out where each piece goes, dropping everything after the
+	// first invalid character
+	bool valid = true;
+	uint64_t carry = w->count;
+	uint64_t bitCount = carry;
+	uint64_t symbols = index == NULL ? 0 : index->symbols;
+	uint64_t bytes = index == NULL ? 0 : index->bytes;
+	for (int ix = 0; ix < threads; ix++) {
+		if (!valid) {
+			jobs[ix].len = 0;
+			jobs[ix].bitCount = 0;
+			jobs[ix].symbols = 0;
+		}
+		jobs[ix].start = bitCount;
+		bitCount += jobs[ix].bitCount;
+		valid = valid && jobs[ix].valid;
+		if (index != NULL) {
+			jobs[ix].index->count = 0;
+			blockIndexSeek(jobs[ix].index, symbols, bytes);
+			symbols += jobs[ix].symbols;
+			bytes += jobs[ix].len;
+		}
+	}
+
+	unsigned char *out = malloc((bitCount + 7) / 8 + 1);
+	for (int ix = 0; ix < threads; ix++) {
+		jobs[ix].out = out;
+	}
+	runJobs(encodeJobWrite, jobs, sizeof(struct encodeJob), threads);
+
+	// fill in the bytes shared between pieces, then the writer's bits
+	out[0] = 0;
+	for (int ix = 0; ix < threads; ix++) {
+		if (jobs[ix].start % 8 == 0) {
+			out[jobs[ix].start / 8] = jobs[ix].head;
+		} else {
+			out[jobs[ix].start / 8] |= jobs[ix].head;
+		}
+	}
+	out[0] |= w->acc >> 56;
+
+	// bit 0 of the window is carry bits before the end of the encoding
+	if (index != NULL) {
+		for (int ix = 0; ix < threads; ix++) {
+			blockIndexAppend(index, jobs[ix].index, w->bitCount - carry);
+		}
+		blockIndexSeek(index, symbols, bytes);
+	}
+
+	// whole bytes are written out, and the rest go back to the writer
+	size_t outBytes = bitCount / 8;
+	bitWriterFlush(w);
+	FileWriteBytes(w->out, (char *)out, outBytes);
+	w->count = bitCount % 8;
+	w->acc = w->count == 0 ? 0 : (uint64_t)out[outBytes] << 56;
+	w->bitCount += bitCount - carry;
+	free(out);
+	return valid;
+}
+
+// thread entry point for measuring the encoding of a piece.
+// a piece with an invalid character is cut short before it.
+static void *encodeJobMeasure(void *arg) {
+	struct encodeJob *job = arg;
+	job->bitCount = 0;
+	job->symbols = 0;
+	job->valid = true;
+	size_t pos = 0;
+	while (pos < job->len) {
+		int charLen = symbolLength(job->table, job->text[pos]);
+		if (charLen == 0 || job->len - pos < (size_t)charLen) {
+			job->valid = false;
+			job->len = pos;
+			break;
+		}
+		struct encoder *enc =
+		    codeTableFind(job->table, characterKey(&job->text[pos], charLen));
+		job->bitCount += enc->length;
+		job->symbols++;
+		pos += charLen;
+	}
+	return NULL;
+}
+
+// thread entry point for writing the encoding of a piece
+static void *encodeJobWrite(void *arg) {
+	struct encodeJob *job = arg;
+	job->head = 0;
+
+	// bits are gathered a word at a time, as in bitWriterPut,
+	// starting part way into the first byte
+	uint64_t acc = 0;
+	int count = job->start % 8;
+	uint64_t byteIndex = job->start / 8;
+	size_t pos = 0;
+	while (pos < job->len) {
+		int charLen = symbolLength(job->table, job->text[pos]);
+		struct encoder *enc =
+		    codeTableFind(job->table, characterKey(&job->text[pos], charLen));
+		if (job->index != NULL) {
+			blockIndexStep(job->index, byteIndex * 8 + count, charLen);
+		}
+		pos += charLen;
+
+		if (enc->length <= 64) {
+			encodeJobPut(job, &acc, &count, &byteIndex, enc->bits,
+			             enc->length);
+			continue;
+		}
+		struct codeChunk *local[LOCAL_CHUNKS];
+		struct codeChunk **chunks = codeTableChunks(job->table, enc, local);
+		for (int ix = 0; ix < (enc->length + 63) / 64; ix++) {
+			encodeJobPut(job, &acc, &count, &byteIndex, chunks[ix]->bits,
+			             chunks[ix]->length - 64 * ix);
+		}
+		if (chunks != local) {
+			free(chunks);
+		}
+	}
+	for (int byte = 0; byte < (count + 7) / 8; byte++) {
+		encodeJobStore(job, byteIndex++, acc >> (56 - 8 * byte));
+	}
+	return NULL;
+}
+
+// append the low len bits of bits to a piece's encoding, where acc holds
+// the count bits gathered so far and byteIndex is the byte they start at.
+// len is at most 64, and any higher bits must be 0.
+static void encodeJobPut(struct encodeJob *job, uint64_t *acc, int *count,
+                         uint64_t *byteIndex, uint64_t bits, int len) {
+	if (len == 0) {
+		return;
+	}
+	int space = 64 - *count;
+	if (len < space) {
+		*acc |= bits << (space - len);
+		*count += len;
+		return;
+	}
+	int rest = len - space;
+	*acc |= bits >> rest;
+	for (int byte = 0; byte < 8; byte++) {
+		encodeJobStore(job, (*byteIndex)++, *acc >> (56 - 8 * byte));
+	}
+	*acc = rest == 0 ? 0 : bits << (64 - rest);
+	*count = rest;
+}
+
+// store a byte of a piece's encoding, keeping back the shared first byte
+static void encodeJobStore(struct encodeJob *job, uint64_t byteIndex,
+                           unsigned char byte) {
+	if (byteIndex == job->start / 8) {
+		job->head = byte;
+	} else {
+		job->out[byteIndex] = byte;
+	}
+}
+
+// get the number of leaves in the tree
+static int leafCount(struct huffmanTree *tree) {
+	if (tree == NULL) {
+		return 0;
+	}
+	int countedLeaves = leafCount(tree->left) + leafCount(tree->right);
+	if (countedLeaves == 0) {
+		return countedLeaves + 1;
+	}
+	return countedLeaves;
+}
+
+// get tree height
+static int treeHeight(struct huffmanTree *tree) {
+	if (tree == NULL) {
+		return 0;
+	} else {
+		int heightLeft = treeHeight(tree->left);
+		int heightRight = treeHeight(tree->right);
+		int max;
+		if (heightLeft > heightRight) {
+			max = heightLeft;
+		} else {
+			max = heightRight;
+		}
+		return max + 1;
+	}
+}
+
+// pack the len bytes of a character into a key.
+// characters are at most 4 bytes, so no two characters share a key.
+static uint32_t characterKey(char *bytes, int len) {
+	uint32_t key = 0;
+	for (int ix = 0; ix < len; ix++) {
+		key |= (uint32_t)(unsigned char)bytes[ix] << (8 * ix);
+	}
+	return key;
+}
+
+// store value in the 8 bytes at bytes, least significant byte first
+static void putUint64(char *bytes, uint64_t value) {
+	for (int ix = 0; ix < 8; ix++) {
+		bytes[ix] = value >> (8 * ix);
+	}
+}
+
+// load a value stored by putUint64
+static uint64_t getUint64(char *bytes) {
+	uint64_t value = 0;
+	for (int ix = 0; ix < 8; ix++) {
+		value |= (uint64_t)(unsigned char)bytes[ix] << (8 * ix);
+	}
+	return value;
+}
+
+// implementation of batchList functions
+
+BatchList BatchListOpen(char *filename) {
+	struct batchList *list = malloc(sizeof(struct batchList));
+	list->fp = fopen(filename, "r");
+	if (list->fp == NULL) {
+		fprintf(stderr, "error: failed to open '%s' for reading\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	list->line = NULL;
+	list->size = 0;
+	return list;
+}
+
+// lines are split at whitespace, in place
+bool BatchListNext(BatchList list, char *names[2]) {
+	while (getline(&list->line, &list->size, list->fp) != -1) {
+		int count = 0;
+		char *rest;
+		char *name = strtok_r(list->line, " \t\r\n", &rest);
+		while (name != NULL) {
+			if (count < 2) {
+				names[count] = name;
+			}
+			count++;
+			name = strtok_r(NULL, " \t\r\n", &rest);
+		}
+		if (count == 2) {
+			return true;
+		} else if (count != 0) {
+			fprintf(stderr, "error: each line of the list should hold two "
+			                "filenames\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return false;
+}
+
+void BatchListClose(BatchList list) {
+	free(list->line);
+	fclose(list->fp);
+	free(list);
+}
+
+// implementation of blockIndex functions
+
+// create an empty block index with blocks of blockLen characters
+static struct blockIndex *blockIndexNew(uint64_t blockLen) {
+	struct blockIndex *index = malloc(sizeof(struct blockIndex));
+	index->entries = NULL;
+	index->count = 0;
+	index->capacity = 0;
+	index->blockLen = blockLen;
+	blockIndexSeek(index, 0, 0);
+	return index;
+}
+
+// carry on indexing from the given character and byte of the text
+static void blockIndexSeek(struct blockIndex *index, uint64_t symbols,
+                           uint64_t bytes) {
+	index->symbols = symbols;
+	index->bytes = bytes;
+	index->blockLeft =
+	    (index->blockLen - symbols % index->blockLen) % index->blockLen;
+}
+
+// account for the next character, of charLen bytes, whose code starts
+// at bit, adding an entry if it starts a block
+static void blockIndexStep(struct blockIndex *index, uint64_t bit,
+                           int charLen) {
+	if (index->blockLeft == 0) {
+		blockIndexAdd(index, bit, index->symbols, index->bytes);
+		index->blockLeft = index->blockLen;
+	}
+	index->blockLeft--;
+	index->symbols++;
+	index->bytes += charLen;
+}
+
+// add an entry to the end of the index
+static void blockIndexAdd(struct blockIndex *index, uint64_t bit,
+                          uint64_t symbol, uint64_t byte) {
+	if (index->count == index->capacity) {
+		index->capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+		struct blockEntry *resize = realloc(
+		    index->entries, sizeof(struct blockEntry) * index->capacity);
+		assert(resize != NULL);
+		index->entries = resize;
+	}
+	struct blockEntry *e = &index->entries[index->count++];
+	e->bit = bit;
+	e->symbol = symbol;
+	e->byte = byte;
+}
+
+// add the entries of other to the end of the index,
+// moving their bits along by bitBase
+static void blockIndexAppend(struct blockIndex *index,
+                             struct blockIndex *other, uint64_t bitBase) {
+	for (size_t ix = 0; ix < other->count; ix++) {
+		struct blockEntry *e = &other->entries[ix];
+		blockIndexAdd(index, bitBase + e->bit, e->symbol, e->byte);
+	}
+}
+
+// find the block holding the given byte of the text, which must be
+// before the end of the text
+static size_t blockIndexFind(struct blockIndex *index, uint64_t byte) {
+	size_t lo = 0;
+	size_t hi = index->count - 1;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (index->entries[mid].byte <= byte) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// write out a finished index
+static void blockIndexWrite(struct blockIndex *index, File out) {
+	size_t size = INDEX_HEADER_LEN + INDEX_ENTRY_LEN * index->count;
+	char *bytes = malloc(size);
+	memcpy(bytes, INDEX_MAGIC, INDEX_MAGIC_LEN);
+	putUint64(bytes + INDEX_MAGIC_LEN, index->blockLen);
+	putUint64(bytes + INDEX_MAGIC_LEN + 8, index->count);
+	for (size_t ix = 0; ix < index->count; ix++) {
+		char *entry = bytes + INDEX_HEADER_LEN + INDEX_ENTRY_LEN * ix;
+		putUint64(entry, index->entries[ix].bit);
+		putUint64(entry + 8, index->entries[ix].symbol);
+		putUint64(entry + 16, index->entries[ix].byte);
+	}
+	FileWriteBytes(out, bytes, size);
+	free(bytes);
+}
+
+// read an index written by blockIndexWrite, which must be held in memory.
+// exits if it is not a well formed index.
+static struct blockIndex *blockIndexRead(File in) {
+	size_t size;
+	char *bytes = FileReadRest(in, &size);
+	if (bytes == NULL || size < INDEX_HEADER_LEN ||
+	    memcmp(bytes, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0) {
+		fprintf(stderr, "error: not a block index\n");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t blockLen = getUint64(bytes + INDEX_MAGIC_LEN);
+	uint64_t count = getUint64(bytes + INDEX_MAGIC_LEN + 8);
+	if (blockLen == 0 || count == 0 ||
+	    count != (size - INDEX_HEADER_LEN) / INDEX_ENTRY_LEN ||
+	    (size - INDEX_HEADER_LEN) % INDEX_ENTRY_LEN != 0) {
+		fprintf(stderr, "error: block index is corrupt\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct blockIndex *index = blockIndexNew(blockLen);
+	for (uint64_t ix = 0; ix < count; ix++) {
+		char *entry = bytes + INDEX_HEADER_LEN + INDEX_ENTRY_LEN * ix;
+		blockIndexAdd(index, getUint64(entry), getUint64(entry + 8),
+		              getUint64(entry + 16));
+		// every block holds at least one character
+		struct blockEntry *e = &index->entries[ix];
+		if (ix == 0 ? e->bit != 0 || e->symbol != 0 || e->byte != 0
+		            : e->bit < e[-1].bit || e->symbol <= e[-1].symbol ||
+		                  e->byte <= e[-1].byte) {
+			fprintf(stderr, "error: block index is corrupt\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return index;
+}
+
+// free a block index
+static void blockIndexFree(struct blockIndex *index) {
+	free(index->entries);
+	free(index);
+}
+
+// implementation of arena functions
+
+// create an empty arena. its first block is allocated when needed.
+static struct arena *arenaNew(void) {
+	struct arena *arena = malloc(sizeof(struct arena));
+	arena->blocks = NULL;
+	arena->next = NULL;
+	arena->left = 0;
+	return arena;
+}
+
+// allocate size bytes, which stay valid until the arena is freed
+static void *arenaAlloc(struct arena *arena, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size > arena->left) {
+		size_t blockLen = size > ARENA_BLOCK_LEN ? size : ARENA_BLOCK_LEN;
+		struct arenaBlock *block =
+		    malloc(sizeof(struct arenaBlock) + blockLen);
+		if (block == NULL) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		block->prev = arena->blocks;
+		arena->blocks = block;
+		arena->next = (char *)block->memory;
+		arena->left = blockLen;
+	}
+	void *memory = arena->next;
+	arena->next += size;
+	arena->left -= size;
+	return memory;
+}
+
+// free the arena along with everything allocated from it
+static void arenaFree(struct arena *arena) {
+	struct arenaBlock *block = arena->blocks;
+	while (block != NULL) {
+		struct arenaBlock *prev = block->prev;
+		free(block);
+		block = prev;
+	}
+	free(arena);
+}
+
+// implementation of flatTree functions
+
+// flatten a tree, whose nodes must have zero or two children.
+// nodes are visited with an explicit stack rather than recursion.
+static struct flatTree *flatTreeNew(struct huffmanTree *tree) {
+	struct flatTree *flat = malloc(sizeof(struct flatTree));
+	uint32_t capacity = 64;
+	flat->nodes = malloc(sizeof(struct flatNode) * capacity);
+	flat->count = 0;
+
+	// the nodes still to be flattened
+	int stackCapacity = 64;
+	struct pendingNode *stack =
+	    malloc(sizeof(struct pendingNode) * stackCapacity);
+	int size = 0;
+	stack[size++] = (struct pendingNode){tree, 0, false};
+	while (size > 0) {
+		struct pendingNode next = stack[--size];
+		if (flat->count == capacity) {
+			capacity *= 2;
+			struct flatNode *resize =
+			    realloc(flat->nodes, sizeof(struct flatNode) * capacity);
+			assert(resize != NULL);
+			flat->nodes = resize;
+		}
+		uint32_t index = flat->count++;
+		if (next.right) {
+			flat->nodes[next.parent].right = index;
+		}
+
+		struct flatNode *n = &flat->nodes[index];
+		struct huffmanTree *t = next.tree;
+		n->left = 0;
+		n->right = 0;
+		n->height = 0;
+		n->len = 0;
+		if (isLeaf(t)) {
+			n->len = strlen(t->character);
+			memcpy(n->character, t->character, n->len);
+			continue;
+		}
+		if (t->left == NULL || t->right == NULL) {
+			fprintf(stderr, "error: found node with exactly one child\n");
+			exit(EXIT_FAILURE);
+		}
+		n->left = index + 1;
+		if (size + 2 > stackCapacity) {
+			stackCapacity *= 2;
+			struct pendingNode *resize =
+			    realloc(stack, sizeof(struct pendingNode) * stackCapacity);
+			assert(resize != NULL);
+			stack = resize;
+		}
+		stack[size++] = (struct pendingNode){t->right, index, true};
+		stack[size++] = (struct pendingNode){t->left, index, false};
+	}
+	free(stack);
+
+	// children come after their parents, so work back from the end
+	for (uint32_t ix = flat->count; ix-- > 0;) {
+		struct flatNode *n = &flat->nodes[ix];
+		if (n->left != 0) {
+			uint32_t left = flat->nodes[n->left].height;
+			uint32_t right = flat->nodes[n->right].height;
+			n->height = (left > right ? left : right) + 1;
+		}
+	}
+	return flat;
+}
+
+// free a flattened tree
+static void flatTreeFree(struct flatTree *flat) {
+	free(flat->nodes);
+	free(flat);
+}
+
+// implementation of tree file functions
+
+// read a tree written out in full, without recursion.
+// the leaves are counted first from the unescaped commas, so that every
+// node, and then every character, can be put in a single allocation,
+// with the nodes in preorder. the nodes whose right subtree is still to
+// come are kept on a stack.
+struct huffmanTree *readHuffmanTreeFile(File in) {
+	size_t len;
+	bool copied;
+	char *text = treeFileBytes(in, &len, &copied);
+	size_t leaves = 1;
+	for (size_t pos = 0; pos < len; pos++) {
+		if (text[pos] == '\\') {
+			pos++;
+		} else if (text[pos] == ',') {
+			leaves++;
+		}
+	}
+	size_t nodeCount = 2 * leaves - 1;
+	struct huffmanTree *nodes = malloc(sizeof(struct huffmanTree) * nodeCount +
+	                                   len + leaves);
+	if (nodes == NULL) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	char *chars = (char *)&nodes[nodeCount];
+	struct huffmanTree **stack =
+	    malloc(sizeof(struct huffmanTree *) * nodeCount);
+	size_t depth = 0;
+	size_t used = 1;
+	struct huffmanTree *node = &nodes[0];
+	size_t pos = 0;
+	while (true) {
+		node->freq = 0;
+		node->left = NULL;
+		node->right = NULL;
+		if (pos < len && text[pos] == '(') {
+			// the left subtree comes next
+			if (used == nodeCount) {
+				treeFileError();
+			}
+			node->character = NULL;
+			stack[depth++] = node;
+			node->left = &nodes[used++];
+			node = node->left;
+			pos++;
+			continue;
+		}
+
+		node->character = chars;
+		int charLen = 0;
+		while (pos < len && text[pos] != ',' && text[pos] != ')') {
+			if (text[pos] == '\\' && pos + 1 < len) {
+				pos++;
+			}
+			if (charLen == MAX_CHARACTER_LEN) {
+				treeFileError();
+			}
+			chars[charLen++] = text[pos++];
+		}
+		if (charLen == 0) {
+			treeFileError();
+		}
+		chars[charLen] = '\0';
+		chars += charLen + 1;
+
+		// go back up past every subtree that this leaf finishes
+		while (depth > 0 && stack[depth - 1]->right != NULL) {
+			if (pos == len || text[pos] != ')') {
+				treeFileError();
+			}
+			pos++;
+			depth--;
+		}
+		if (depth == 0) {
+			break;
+		}
+		if (pos == len || text[pos] != ',' || used == nodeCount) {
+			treeFileError();
+		}
+		stack[depth - 1]->right = &nodes[used++];
+		node = stack[depth - 1]->right;
+		pos++;
+	}
+
+	free(stack);
+	if (copied) {
+		free(text);
+	}
+	return nodes;
+}
+
+// read in the rest of in, which is used where it lies if it is already
+// held in memory, and otherwise copied into a buffer, setting *copied
+static char *treeFileBytes(File in, size_t *len, bool *copied) {
+	char *text = FileReadRest(in, len);
+	*copied = text == NULL;
+	if (text != NULL) {
+		return text;
+	}
+	size_t capacity = READ_CHUNK_LEN;
+	text = malloc(capacity);
+	*len = 0;
+	size_t got;
+	while ((got = FileReadBytes(in, text + *len, capacity - *len)) > 0) {
+		*len += got;
+		if (*len == capacity) {
+			capacity *= 2;
+			text = realloc(text, capacity);
+			assert(text != NULL);
+		}
+	}
+	return text;
+}
+
+static void treeFileError(void) {
+	fprintf(stderr, "error: invalid tree file\n");
+	exit(EXIT_FAILURE);
+}
+
+// implementation of canonicalCode functions
+
+// create the canonical code for the characters of tree,
+// keeping the code length of each character
+CanonicalCode CanonicalCodeNew(struct huffmanTree *tree) {
+	struct canonicalCode *code = malloc(sizeof(struct canonicalCode));
+	code->symbols = malloc(sizeof(struct canonicalSymbol) * leafCount(tree));
+	code->count = 0;
+	code->bytes = false;
+	canonicalCollect(code, tree, 0);
+	canonicalAssign(code);
+	return code;
+}
+
+// read a canonical code or a byte code, or return NULL if in does not
+// start with CANONICAL_MAGIC or BYTE_CODE_MAGIC.
+// exits if the code is not well formed.
+CanonicalCode CanonicalCodeRead(File in) {
+	char magic[CANONICAL_MAGIC_LEN];
+	size_t magicLen = FileReadBytes(in, magic, CANONICAL_MAGIC_LEN);
+	if (magicLen == CANONICAL_MAGIC_LEN &&
+	    memcmp(magic, BYTE_CODE_MAGIC, CANONICAL_MAGIC_LEN) == 0) {
+		return byteCodeRead(in);
+	} else if (magicLen != CANONICAL_MAGIC_LEN ||
+	           memcmp(magic, CANONICAL_MAGIC, CANONICAL_MAGIC_LEN) != 0) {
+		// put back what was read, so in can be read as something else
+		FileRewind(in);
+		return NULL;
+	}
+
+	struct canonicalCode *code = malloc(sizeof(struct canonicalCode));
+	code->symbols = NULL;
+	code->count = 0;
+	code->bytes = false;
+	int capacity = 0;
+	char length;
+	while (FileReadBytes(in, &length, 1) == 1) {
+		char *character;
+		int len = FileNextCharacter(in, &character);
+		if (len == 0) {
+			fprintf(stderr, "error: canonical code is truncated\n");
+			exit(EXIT_FAILURE);
+		}
+		if (code->count == capacity) {
+			capacity = capacity == 0 ? 64 : capacity * 2;
+			struct canonicalSymbol *resize = realloc(
+			    code->symbols, sizeof(struct canonicalSymbol) * capacity);
+			assert(resize != NULL);
+			code->symbols = resize;
+		}
+		struct canonicalSymbol *sym = &code->symbols[code->count++];
+		memcpy(sym->character, character, len);
+		sym->character[len] = '\0';
+		sym->len = len;
+		sym->length = (unsigned char)length;
+	}
+	if (code->count == 0) {
+		fprintf(stderr, "error: canonical code has no characters\n");
+		exit(EXIT_FAILURE);
+	}
+	canonicalAssign(code);
+	return code;
+}
+
+// write out the code length and bytes of each character,
+// or for a byte code, the code length of every byte
+void CanonicalCodeWrite(CanonicalCode code, File out) {
+	if (code->bytes) {
+		char bytes[CANONICAL_MAGIC_LEN + BYTE_SYMBOLS] = {0};
+		memcpy(bytes, BYTE_CODE_MAGIC, CANONICAL_MAGIC_LEN);
+		for (int ix = 0; ix < code->count; ix++) {
+			struct canonicalSymbol *sym = &code->symbols[ix];
+			unsigned char byte = sym->character[0];
+			bytes[CANONICAL_MAGIC_LEN + byte] = sym->length + 1;
+		}
+		FileWriteBytes(out, bytes, sizeof(bytes));
+		return;
+	}
+
+	size_t size = CANONICAL_MAGIC_LEN;
+	char *bytes = malloc(size + (MAX_CHARACTER_LEN + 1) * code->count);
+	memcpy(bytes, CANONICAL_MAGIC, CANONICAL_MAGIC_LEN);
+	for (int ix = 0; ix < code->count; ix++) {
+		struct canonicalSymbol *sym = &code->symbols[ix];
+		bytes[size++] = sym->length;
+		memcpy(bytes + size, sym->character, sym->len);
+		size += sym->len;
+	}
+	FileWriteBytes(out, bytes, size);
+	free(bytes);
+}
+
+// create the byte code of everything left in in.
+// the bytes are counted into an array, and their code lengths chosen
+// by package-merge, which keeps them within 64 bits.
+CanonicalCode CanonicalCodeNewBytes(File in) {
+	uint64_t counts[BYTE_SYMBOLS];
+	byteCount(in, counts);
+	struct canonicalCode *code = malloc(sizeof(struct canonicalCode));
+	code->symbols = malloc(sizeof(struct canonicalSymbol) * BYTE_SYMBOLS);
+	code->count = 0;
+	code->bytes = true;
+	uint64_t weights[BYTE_SYMBOLS];
+	for (int byte = 0; byte < BYTE_SYMBOLS; byte++) {
+		if (counts[byte] == 0) {
+			continue;
+		}
+		struct canonicalSymbol *sym = &code->symbols[code->count];
+		memset(sym->character, 0, MAX_CHARACTER_LEN + 1);
+		sym->character[0] = byte;
+		sym->len = 1;
+		sym->length = 0;
+		weights[code->count++] = counts[byte];
+	}
+	if (code->count == 0) {
+		fprintf(stderr, "error: there are no bytes to build a code from\n");
+		exit(EXIT_FAILURE);
+	}
+	if (code->count > 1) {
+		int *lengths = packageMerge(weights, code->count, 64);
+		for (int ix = 0; ix < code->count; ix++) {
+			code->symbols[ix].length = lengths[ix];
+		}
+		free(lengths);
+	} else {
+		// a lone byte gets a 1 bit code rather than an empty one, so the
+		// encoding still records how many bytes there are
+		code->symbols[0].length = 1;
+	}
+	canonicalAssign(code);
+	return code;
+}
+
+// free a canonical code
+void CanonicalCodeFree(CanonicalCode code) {
+	free(code->symbols);
+	free(code);
+}
+
+// count every byte left in in, four bytes at a time into separate
+// counts, so that runs of the same byte do not wait on each other
+static void byteCount(File in, uint64_t counts[BYTE_SYMBOLS]) {
+	uint64_t partial[4][BYTE_SYMBOLS] = {{0}};
+	size_t len;
+	char *text = FileReadRest(in, &len);
+	char *chunk = text == NULL ? malloc(READ_CHUNK_LEN) : NULL;
+	if (text == NULL) {
+		text = chunk;
+		len = FileReadBytes(in, chunk, READ_CHUNK_LEN);
+	}
+	while (len > 0) {
+		unsigned char *bytes = (unsigned char *)text;
+		size_t pos = 0;
+		for (; pos + 4 <= len; pos += 4) {
+			partial[0][bytes[pos]]++;
+			partial[1][bytes[pos + 1]]++;
+			partial[2][bytes[pos + 2]]++;
+			partial[3][bytes[pos + 3]]++;
+		}
+		for (; pos < len; pos++) {
+			partial[0][bytes[pos]]++;
+		}
+		len = chunk == NULL ? 0 : FileReadBytes(in, chunk, READ_CHUNK_LEN);
+	}
+	free(chunk);
+	for (int byte = 0; byte < BYTE_SYMBOLS; byte++) {
+		counts[byte] = partial[0][byte] + partial[1][byte] +
+		               partial[2][byte] + partial[3][byte];
+	}
+}
+
+// read the code lengths of a byte code, after its magic
+static CanonicalCode byteCodeRead(File in) {
+	unsigned char lengths[BYTE_SYMBOLS];
+	if (FileReadBytes(in, (char *)lengths, BYTE_SYMBOLS) != BYTE_SYMBOLS) {
+		fprintf(stderr, "error: byte code is truncated\n");
+		exit(EXIT_FAILURE);
+	}
+	struct canonicalCode *code = malloc(sizeof(struct canonicalCode));
+	code->symbols = malloc(sizeof(struct canonicalSymbol) * BYTE_SYMBOLS);
+	code->count = 0;
+	code->bytes = true;
+	for (int byte = 0; byte < BYTE_SYMBOLS; byte++) {
+		if (lengths[byte] == 0) {
+			continue;
+		}
+		struct canonicalSymbol *sym = &code->symbols[code->count++];
+		memset(sym->character, 0, MAX_CHARACTER_LEN + 1);
+		sym->character[0] = byte;
+		sym->len = 1;
+		sym->length = lengths[byte] - 1;
+	}
+	if (code->count == 0) {
+		fprintf(stderr, "error: byte code has no bytes\n");
+		exit(EXIT_FAILURE);
+	}
+	if (code->count == 1) {
+		// as in CanonicalCodeNewBytes
+		code->symbols[0].length = 1;
+	}
+	canonicalAssign(code);
+	return code;
+}
+
+// add the leaves of tree to code, with their depth as their code length
+static void canonicalCollect(struct canonicalCode *code,
+                             struct huffmanTree *tree, int depth) {
+	if (isLeaf(tree)) {
+		struct canonicalSymbol *sym = &code->symbols[code->count++];
+		strncpy(sym->character, tree->character, MAX_CHARACTER_LEN + 1);
+		sym->len = strlen(sym->character);
+		sym->length = depth;
+	} else {
+		canonicalCollect(code, tree->left, depth + 1);
+		canonicalCollect(code, tree->right, depth + 1);
+	}
+}
+
+// sort the characters into canonical order and give them their codes.
+// each code is the one after the previous code, extended with 0s to
+// its length. exits if a character appears twice, or if the code
+// lengths do not make a complete code.
+static void canonicalAssign(struct canonicalCode *code) {
+	struct canonicalSymbol *symbols = code->symbols;
+	// sorting by character first puts repeats next to each other,
+	// whatever their code lengths
+	qsort(symbols, code->count, sizeof(struct canonicalSymbol),
+	      characterCompare);
+	for (int ix = 1; ix < code->count; ix++) {
+		if (characterCompare(&symbols[ix], &symbols[ix - 1]) == 0) {
+			fprintf(stderr, "error: character '%s' appears twice in the "
+			                "code\n",
+			        symbols[ix].character);
+			exit(EXIT_FAILURE);
+		}
+	}
+	qsort(symbols, code->count, sizeof(struct canonicalSymbol),
+	      canonicalCompare);
+
+	// a lone character has an empty code, or a 1 bit code in byte codes
+	bool valid = code->count == 1 ? symbols[0].length <= 1
+	                              : symbols[0].length > 0;
+	for (int ix = 0; valid && ix < code->count; ix++) {
+		struct canonicalSymbol *sym = &symbols[ix];
+		if (sym->length > 64) {
+			fprintf(stderr, "error: codes longer than 64 bits are not "
+			                "supported\n");
+			exit(EXIT_FAILURE);
+		}
+		if (ix == 0) {
+			sym->code = 0;
+			continue;
+		}
+		struct canonicalSymbol *prev = &symbols[ix - 1];
+		// a code of all 1s leaves no room for longer codes
+		if (prev->code == UINT64_MAX >> (64 - prev->length)) {
+			valid = false;
+			break;
+		}
+		sym->code = (prev->code + 1) << (sym->length - prev->length);
+	}
+
+	struct canonicalSymbol *last = &symbols[code->count - 1];
+	if (!valid ||
+	    (code->count > 1 && last->code != UINT64_MAX >> (64 - last->length))) {
+		fprintf(stderr, "error: code lengths do not make a complete code\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// order characters by code length, then by their bytes
+static int canonicalCompare(const void *a, const void *b) {
+	const struct canonicalSymbol *symA = a;
+	const struct canonicalSymbol *symB = b;
+	if (symA->length != symB->length) {
+		return symA->length - symB->length;
+	}
+	return characterCompare(a, b);
+}
+
+// order characters by their bytes alone
+static int characterCompare(const void *a, const void *b) {
+	const struct canonicalSymbol *symA = a;
+	const struct canonicalSymbol *symB = b;
+	int len = symA->len < symB->len ? symA->len : symB->len;
+	int order = memcmp(symA->character, symB->character, len);
+	return order != 0 ? order : symA->len - symB->len;
+}
+
+// the n bits of a character's code after its first from bits,
+// where n is at least 1
+static uint64_t canonicalBits(struct canonicalSymbol *sym, int from, int n) {
+	return (sym->code >> (sym->length - from - n)) & (UINT64_MAX >> (64 - n));
+}
+
+// implementation of codeTable functions
+
+// generate the encoder of every character in the tree in a single depth
+// first pass over the flattened tree, and index them by character.
+static struct codeTable *codeTableNew(struct flatTree *flat) {
+	int count = (flat->count + 1) / 2;
+	struct encoder *encoders = malloc(sizeof(struct encoder) * count);
+
+	// nodes still to be visited, along with their code. only the right
+	// child of each node on the current path waits on the stack,
+	// so it never holds more than one node per level.
+	struct pendingCode *stack =
+	    malloc(sizeof(struct pendingCode) * (flat->nodes[0].height + 1));
+	int size = 0;
+	int found = 0;
+	struct codeChunk *chunks = NULL;
+	uint32_t chunkCount = 0;
+	uint32_t chunkCapacity = 0;
+	stack[size++] = (struct pendingCode){0, 0, 0, NO_CHUNK};
+	while (size > 0) {
+		struct pendingCode next = stack[--size];
+		struct flatNode *n = &flat->nodes[next.node];
+		if (n->left == 0) {
+			struct encoder *enc = &encoders[found++];
+			enc->key = characterKey(n->character, n->len);
+			enc->length = next.length;
+			enc->bits = next.bits;
+			if (next.chunk != NO_CHUNK) {
+				// the code ends in a chunk of its own
+				enc->bits = codeChunkAdd(
+				    &chunks, &chunkCount, &chunkCapacity,
+				    (struct codeChunk){next.bits, next.chunk, next.length});
+			}
+			continue;
+		}
+		if (next.length > 0 && next.length % 64 == 0) {
+			// the children's codes go on past a whole chunk
+			next.chunk = codeChunkAdd(
+			    &chunks, &chunkCount, &chunkCapacity,
+			    (struct codeChunk){next.bits, next.chunk, next.length});
+			next.bits = 0;
+		}
+		stack[size++] = (struct pendingCode){n->right, (next.bits << 1) | 1,
+		                                     next.length + 1, next.chunk};
+		stack[size++] = (struct pendingCode){n->left, next.bits << 1,
+		                                     next.length + 1, next.chunk};
+	}
+	free(stack);
+	struct codeTable *table = codeTableIndex(encoders, count);
+	table->chunks = chunks;
+	table->chunkCount = chunkCount;
+	return table;
+}
+
+// generate the encoder of every character of a canonical code,
+// and index them by character.
+static struct codeTable *codeTableNewCanonical(CanonicalCode code) {
+	struct encoder *encoders = malloc(sizeof(struct encoder) * code->count);
+	for (int ix = 0; ix < code->count; ix++) {
+		struct canonicalSymbol *sym = &code->symbols[ix];
+		struct encoder *enc = &encoders[ix];
+		enc->key = characterKey(sym->character, sym->len);
+		enc->length = sym->length;
+		enc->bits = sym->code;
+	}
+	struct codeTable *table = codeTableIndex(encoders, code->count);
+	table->bytes = code->bytes;
+	return table;
+}
+
+// index count encoders by character, taking ownership of them
+static struct codeTable *codeTableIndex(struct encoder *encoders, int count) {
+	struct codeTable *table = malloc(sizeof(struct codeTable));
+	table->encoders = encoders;
+	table->count = count;
+
+	// keep the hash table at most half full
+	table->hashBits = 1;
+	while ((1 << table->hashBits) < 2 * count) {
+		table->hashBits++;
+	}
+	table->mask = (1u << table->hashBits) - 1;
+	table->direct =
+	    malloc(sizeof(struct encoder) * (DIRECT_KEYS + table->mask + 1));
+	table->slots = table->direct + DIRECT_KEYS;
+	table->bytes = false;
+	table->chunks = NULL;
+	table->chunkCount = 0;
+	for (int ix = 0; ix < DIRECT_KEYS; ix++) {
+		table->direct[ix].key = ix;
+		table->direct[ix].length = -1;
+		table->direct[ix].bits = 0;
+	}
+	for (uint32_t ix = 0; ix <= table->mask; ix++) {
+		table->slots[ix].key = 0;
+		table->slots[ix].length = -1;
+		table->slots[ix].bits = 0;
+	}
+
+	for (int ix = 0; ix < count; ix++) {
+		uint32_t key = encoders[ix].key;
+		if (key < DIRECT_KEYS) {
+			table->direct[key] = encoders[ix];
+			continue;
+		}
+		uint32_t slot = (key * 0x9E3779B1u) >> (32 - table->hashBits);
+		while (table->slots[slot].length >= 0) {
+			slot = (slot + 1) & table->mask;
+		}
+		table->slots[slot] = encoders[ix];
+	}
+	return table;
+}
+
+// add chunk to the count chunks of a code table being built, which has
+// room for capacity of them, and return its index
+static uint32_t codeChunkAdd(struct codeChunk **chunks, uint32_t *count,
+                             uint32_t *capacity, struct codeChunk chunk) {
+	if (*count == *capacity) {
+		*capacity = *capacity == 0 ? 16 : *capacity * 2;
+		*chunks = realloc(*chunks, sizeof(struct codeChunk) * *capacity);
+		assert(*chunks != NULL);
+	}
+	(*chunks)[*count] = chunk;
+	return (*count)++;
+}
+
+// find the encoder for a character.
+// exits if the character does not appear in the tree.
+static struct encoder *codeTableFind(struct codeTable *table,
+                                     uint32_t key) {
+	if (key < DIRECT_KEYS) {
+		if (table->direct[key].length >= 0) {
+			return &table->direct[key];
+		}
+	} else {
+		uint32_t slot = (key * 0x9E3779B1u) >> (32 - table->hashBits);
+		while (table->slots[slot].length >= 0) {
+			if (table->slots[slot].key == key) {
+				return &table->slots[slot];
+			}
+			slot = (slot + 1) & table->mask;
+		}
+	}
+	char character[MAX_CHARACTER_LEN + 1];
+	for (int ix = 0; ix <= MAX_CHARACTER_LEN; ix++) {
+		character[ix] = ix < MAX_CHARACTER_LEN ? key >> (8 * ix) : '\0';
+	}
+	fprintf(stderr, "error: character '%s' is not in the tree\n", character);
+	exit(EXIT_FAILURE);
+}
+
+// the chunks of a code longer than 64 bits, from first to last.
+// they are put in local if there are at most LOCAL_CHUNKS of them,
+// and in an allocated array otherwise, which the caller frees.
+static struct codeChunk **codeTableChunks(struct codeTable *table,
+                                          struct encoder *enc,
+                                          struct codeChunk **local) {
+	int count = (enc->length + 63) / 64;
+	struct codeChunk **chunks = local;
+	if (count > LOCAL_CHUNKS) {
+		chunks = malloc(sizeof(struct codeChunk *) * count);
+	}
+	uint32_t chunk = enc->bits;
+	for (int ix = count - 1; ix >= 0; ix--) {
+		chunks[ix] = &table->chunks[chunk];
+		chunk = chunks[ix]->prev;
+	}
+	return chunks;
+}
+
+// the number of bits needed to encode the characters counted in
+// counter. exits if one of them does not appear in the table.
+static uint64_t codeTableCost(struct codeTable *table, Counter counter) {
+	int count;
+	struct item *items = CounterItems(counter, &count);
+	uint64_t bits = 0;
+	for (int ix = 0; ix < count; ix++) {
+		char *character = items[ix].character;
+		struct encoder *enc =
+		    codeTableFind(table, characterKey(character, strlen(character)));
+		bits += (uint64_t)items[ix].freq * enc->length;
+	}
+	free(items);
+	return bits;
+}
+
+// free code table along with its encoders
+static void codeTableFree(struct codeTable *table) {
+	free(table->encoders);
+	free(table->chunks);
+	free(table->direct);
+	free(table);
+}
+
+// implementation of buffer functions
+
+// create a new buffer with an initial size, which must not be 0.
+struct buffer *bufferInit(size_t size) {
+	assert(size > 0);
+	struct buffer *nBuf = malloc(sizeof(struct buffer));
+	nBuf->charCount = 0;
+	nBuf->capacity = size;
+	nBuf->str = malloc(nBuf->capacity);
+	assert(nBuf->str != NULL);
+	return nBuf;
+}
+
+// insert the low len bits of bits to buffer as text,
+// doubling the string allocation if necessary.
+// there is always room left for a terminating null byte.
+static void bufferInsert(struct buffer *buf, uint64_t bits, int len) {
+	size_t newCount = buf->charCount + len;
+	if (newCount >= buf->capacity) {
+		while (newCount >= buf->capacity) {
+			buf->capacity *= 2;
+		}
+		char *resize = realloc(buf->str, buf->capacity);
+		assert(resize != NULL);
+		buf->str = resize;
+	}
+	bitsToText(&buf->str[buf->charCount], bits, len);
 	buf->charCount = newCount;
 }
 
-// return the string stored in the buffer
+// insert the code of enc to buffer as text, a chunk at a time if it is
+// longer than 64 bits
+static void bufferInsertCode(struct buffer *buf, struct codeTable *table,
+                             struct encoder *enc) {
+	if (enc->length <= 64) {
+		bufferInsert(buf, enc->bits, enc->length);
+		return;
+	}
+	struct codeChunk *local[LOCAL_CHUNKS];
+	struct codeChunk **chunks = codeTableChunks(table, enc, local);
+	for (int ix = 0; ix < (enc->length + 63) / 64; ix++) {
+		bufferInsert(buf, chunks[ix]->bits, chunks[ix]->length - 64 * ix);
+	}
+	if (chunks != local) {
+		free(chunks);
+	}
+}
+
+// return the string stored in the buffer, which is handed over to
+// the caller rather than copied. nothing more may be inserted.
 static char *bufferGetStr(struct buffer *buf) {
-	char *output = malloc(buf->charCount + 1);
-	strncpy(output, buf->str, buf->charCount + 1);
+	char *output = buf->str;
 	output[buf->charCount] = '\0';
+	buf->str = NULL;
 	return output;
 }
 
@@ -5,6 +5,11 @@
 #ifndef HUFFMAN_H
 #define HUFFMAN_H
 
+#include <stdint.h>
+
+#include "Counter.h"
+#include "File.h"
+
 struct huffmanTree {
 	char *character; // should be NULL unless the node is a leaf
 	int freq;
@@ -17,8 +22,152 @@ void decode(struct huffmanTree *tree, char *encoding, char *outputFilename);
 
 // Part 3
 struct huffmanTree *createHuffmanTree(char *inputFilename);
+struct huffmanTree *createHuffmanTreeStream(File in);
+
+// creates a tree like createHuffmanTreeStream, but with codes of at most
+// maxLength bits. if the huffman tree has longer codes, the code lengths
+// are chosen by package-merge, which gives the shortest encoding within
+// the limit. sets *optimalBits and *limitedBits to the length of the
+// encoding of the input without and with the limit.
+struct huffmanTree *createLimitedHuffmanTreeStream(File in, int maxLength,
+                                                   uint64_t *optimalBits,
+                                                   uint64_t *limitedBits);
+
+// sets the number of threads used by createHuffmanTree, for packed
+// encodings by HuffmanModelEncode and by HuffmanModelDecodeIndexed,
+// where 0 (the default) means one per online processor. small inputs
+// use fewer.
+void setHuffmanThreads(int threads);
 
 // Part 4
 char *encode(struct huffmanTree *tree, char *inputFilename);
 
+// Encoding files
+// ENCODING_TEXT stores one '0' or '1' character per bit, as returned by
+// encode, and is mostly useful for debugging. ENCODING_PACKED stores 8
+// bits per byte between a magic and a final byte holding the number of
+// bits used in the last byte, so neither format needs a seekable output.
+enum encodingFormat {
+	ENCODING_TEXT,
+	ENCODING_PACKED,
+};
+
+// Block indexes
+// a block index records where every blockLen'th character starts, both
+// in the encoding and in the text, so that the encoding can be decoded
+// on several threads or from the middle. it is kept in its own file
+// alongside the encoding.
+
+// Tree files
+// reads a tree written out in full, where each internal node is written
+// as (left,right), and '(', ')', ',' and '\\' in characters are escaped
+// with a '\\'. the rest of in is read at once and parsed without
+// recursion, so very deep trees are fine. every node and character of
+// the tree is kept in one allocation starting at the root, so the tree
+// is freed by freeing the root alone. exits if in does not hold a tree.
+struct huffmanTree *readHuffmanTreeFile(File in);
+
+// Canonical codes
+// a canonical code gives each character the code length it has in a
+// huffman tree, but assigns the codes themselves in order of length,
+// then character. only the code lengths need to be stored, and both
+// codes and decode tables are built straight from them.
+typedef struct canonicalCode *CanonicalCode;
+
+// creates the canonical code for the characters of tree
+CanonicalCode CanonicalCodeNew(struct huffmanTree *tree);
+
+// reads a canonical code written by CanonicalCodeWrite from in, which
+// must be held in memory, e.g., by opening it with FileOpenToReread.
+// returns NULL if in does not hold a canonical code (or a byte code),
+// e.g. it holds a tree written out in full, after rewinding in so that
+// it can be read again from the start.
+CanonicalCode CanonicalCodeRead(File in);
+
+// writes the code as (code length, character) pairs, after a header
+void CanonicalCodeWrite(CanonicalCode code, File out);
+
+void CanonicalCodeFree(CanonicalCode code);
+
+// Byte codes
+// a byte code is a canonical code whose symbols are the bytes of the
+// input rather than its UTF-8 characters, so that any file can be
+// encoded, including binary files. bytes are counted into an array
+// rather than a Counter, and the code is stored as the code lengths of
+// all 256 bytes. CanonicalCodeRead and CanonicalCodeWrite read and
+// write byte codes too, and their models encode and decode like those of
+// any other canonical code.
+
+// creates the byte code of everything left in in, which must not be
+// empty. codes are at most 64 bits long.
+CanonicalCode CanonicalCodeNewBytes(File in);
+
+// Models
+// a model holds both the codes used to encode and the tables used to
+// decode, built once from a tree, a canonical code or character counts.
+// it can then encode and decode any number of inputs, e.g., many small
+// records sharing one model, without being rebuilt for each of them.
+typedef struct huffmanModel *HuffmanModel;
+
+HuffmanModel HuffmanModelNew(struct huffmanTree *tree);
+HuffmanModel HuffmanModelNewCanonical(CanonicalCode code);
+
+// creates the model of the huffman tree of the characters in counter,
+// which must not be empty
+HuffmanModel HuffmanModelNewCounts(Counter counter);
+
+// encodes everything left in in, writing the encoding to out as it goes,
+// and a block index of blockLen characters per block to index unless it
+// is NULL.
+void HuffmanModelEncode(HuffmanModel model, File in, File out,
+                        enum encodingFormat format, File index,
+                        int blockLen);
+
+// decodes the encoding in in, in either format, writing the text to out.
+// the encoding is read in chunks as decoding goes.
+void HuffmanModelDecode(HuffmanModel model, File in, File out);
+
+// decodes bytes from up to (but not including) to of the text encoded
+// in in, using its block index. to is cut down to the length of the
+// text. in and index must be held in memory, e.g., by opening them with
+// FileOpenToReread. blocks are decoded on several threads, as set by
+// setHuffmanThreads.
+void HuffmanModelDecodeIndexed(HuffmanModel model, File in, File index,
+                               File out, size_t from, size_t to);
+
+// writes the model's tables as they are laid out in memory, so that
+// HuffmanModelLoad can use them without reading them in. the file can
+// only be loaded on machines with the same byte order and layout.
+void HuffmanModelWrite(HuffmanModel model, File out);
+
+// loads a model written by HuffmanModelWrite from file, which must be
+// held in memory, e.g., by opening it with FileOpenToReread. the model
+// uses its tables where they lie, so it takes file and closes it when
+// freed. returns NULL if file does not hold a model, e.g. it holds a
+// tree or a canonical code, after rewinding it.
+HuffmanModel HuffmanModelLoad(File file);
+
+// loads or builds the model of a tree file, which may hold a model
+// written by HuffmanModelWrite, a canonical code, a byte code or a tree
+// written out in full. exits if it holds none of them.
+HuffmanModel HuffmanModelRead(char *filename);
+
+void HuffmanModelFree(HuffmanModel model);
+
+// Batch lists
+// a batch list names the files of a batch of inputs that share a model,
+// with two filenames on each line separated by whitespace, e.g. an input
+// and the file to write its encoding to. blank lines are skipped.
+typedef struct batchList *BatchList;
+
+// opens a batch list, exiting if it cannot be opened
+BatchList BatchListOpen(char *filename);
+
+// sets names to the filenames on the next line of the list, which stay
+// valid until the next call. exits if the line does not hold exactly two
+// filenames. returns false at the end of the list.
+bool BatchListNext(BatchList list, char *names[2]);
+
+void BatchListClose(BatchList list);
+
 #endif
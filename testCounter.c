@@ -11,11 +11,15 @@
 static void test1(void);
 static void test2(void);
 static void test3(void);
+static void test4(void);
+static void test5(void);
 
 int main(void) {
     test1();
     test2();
     test3();
+    test4();
+    test5();
 }
 
 static void test1(void) {
@@ -103,3 +107,81 @@ static void test3(void) {
 
     printf("Test 3 passed!\n");
 }
+
+static void test4(void) {
+    Counter counter = CounterNew();
+
+    // enough distinct multi-byte characters to make the counter grow
+    char character[MAX_CHARACTER_LEN + 1];
+    for (int i = 0; i < 1000; i++) {
+        int codePoint = 0x4E00 + i;
+        character[0] = 0xE0 | (codePoint >> 12);
+        character[1] = 0x80 | ((codePoint >> 6) & 0x3F);
+        character[2] = 0x80 | (codePoint & 0x3F);
+        character[3] = '\0';
+        for (int j = 0; j <= i % 3; j++) {
+            CounterAdd(counter, character);
+        }
+    }
+    CounterAdd(counter, "a");
+    CounterAdd(counter, "\xC3\xA9");
+    CounterAdd(counter, "\xF0\x9F\x98\x80");
+
+    assert(CounterNumItems(counter) == 1003);
+    assert(CounterGet(counter, "\xE4\xB8\x80") == 1);
+    assert(CounterGet(counter, "\xE4\xB8\x81") == 2);
+    assert(CounterGet(counter, "\xE4\xB8\x82") == 3);
+    assert(CounterGet(counter, "a") == 1);
+    assert(CounterGet(counter, "\xC3\xA9") == 1);
+    assert(CounterGet(counter, "\xF0\x9F\x98\x80") == 1);
+    assert(CounterGet(counter, "\xF0\x9F\x98\x81") == 0);
+
+    int numItems = 0;
+    struct item *items = CounterItems(counter, &numItems);
+    assert(numItems == 1003);
+    int total = 0;
+    for (int i = 0; i < numItems; i++) {
+        total += items[i].freq;
+        assert(CounterGet(counter, items[i].character) == items[i].freq);
+    }
+    assert(total == 2002);
+
+    free(items);
+    CounterFree(counter);
+
+    printf("Test 4 passed!\n");
+}
+
+static void test5(void) {
+    Counter counter = CounterNew();
+    Counter other = CounterNew();
+
+    char *characters[10] = {
+        "a", "d", "c", "a", "\xC3\xA9", "d", "a", "a", "c", "\xC3\xA9"
+    };
+
+    char character[MAX_CHARACTER_LEN + 1];
+    for (int i = 0; i < 10; i++) {
+        strcpy(character, characters[i]);
+        CounterAdd(i < 5 ? counter : other, character);
+    }
+    CounterAdd(other, "b");
+
+    CounterMerge(counter, other);
+
+    assert(CounterNumItems(counter) == 5);
+    assert(CounterGet(counter, "a") == 4);
+    assert(CounterGet(counter, "b") == 1);
+    assert(CounterGet(counter, "c") == 2);
+    assert(CounterGet(counter, "d") == 2);
+    assert(CounterGet(counter, "\xC3\xA9") == 2);
+
+    // other is left as it was
+    assert(CounterNumItems(other) == 5);
+    assert(CounterGet(other, "a") == 2);
+
+    CounterFree(other);
+    CounterFree(counter);
+
+    printf("Test 5 passed!\n");
+}